@@ -0,0 +1,416 @@
+#include "copy.h"
+
+#include <linux/delay.h>
+#include <linux/export.h>
+#include <linux/ktime.h>
+#include <linux/minmax.h>
+#include <linux/moduleparam.h>
+#include <linux/overflow.h>
+#include <linux/slab.h>
+
+#define COPY_WINDOW		(256)	// chunks in flight
+#define COPY_MIN_CHUNK		(SZ_64K)
+#define COPY_CHUNKS_PER_CHAN	(4)
+#define COPY_BACKOFF_US		(10)	// wait for a full WQ with nothing of ours in it
+
+#define COPY_SG_DEPTH		(4)	// batches in flight
+#define COPY_SG_MAX_BATCH	(128)	// IDXD_ALLOCATED_BATCH_SIZE
+
+static unsigned int chunk_size;
+module_param(chunk_size, uint, 0644);
+MODULE_PARM_DESC(chunk_size, "Bytes per descriptor of a bulk copy, 0 to size chunks by the number of channels (default 0)");
+
+struct copy_chunk {
+	int idx;	// channel
+	dma_addr_t src, dst;
+	u32 len;
+};
+
+struct copy_job {
+	struct dsa_chan **chans;
+	int nr_chan;
+
+	struct copy_chunk chunk[COPY_WINDOW];
+
+	// Completion records, one per window slot, mapped for every channel
+	struct dsa_completion_record *comp;
+	dma_addr_t comp_dma[];
+};
+
+/*
+ * Enough chunks for every channel to have a few in flight, but no smaller
+ * than COPY_MIN_CHUNK so that the descriptor overhead stays negligible, and
+ * no larger than the smallest max_xfer of the channels.
+ */
+static size_t copy_chunk_size(struct dsa_chan **chans, int nr_chan, size_t len)
+{
+	u64 max_xfer = chans[0]->max_xfer;
+	size_t size;
+	int i;
+
+	for (i = 1; i < nr_chan; i++)
+		max_xfer = min(max_xfer, chans[i]->max_xfer);
+
+	if (chunk_size)
+		size = chunk_size;
+	else
+		size = max_t(size_t, round_up(DIV_ROUND_UP(len, nr_chan * COPY_CHUNKS_PER_CHAN), PAGE_SIZE), COPY_MIN_CHUNK);
+
+	return min_t(u64, size, max_xfer);
+}
+
+static void copy_unmap(struct copy_job *job, struct copy_chunk *ch)
+{
+	chan_unmap(job->chans[ch->idx], ch->src, ch->len);
+	chan_unmap(job->chans[ch->idx], ch->dst, ch->len);
+}
+
+static int copy_submit(struct copy_job *job, struct copy_chunk *ch, int slot, void *dst, const void *src)
+{
+	struct dsa_chan *c = job->chans[ch->idx];
+	struct dsa_hw_desc desc;
+	int rc;
+
+	ch->src = chan_map(c, (void *)src, ch->len);
+	ch->dst = chan_map(c, dst, ch->len);
+
+	dsa_prep(&desc, DSA_OPCODE_MEMMOVE, ch->src, ch->dst, ch->len,
+	         job->comp_dma[ch->idx] + slot * sizeof(struct dsa_completion_record), dsa_comp_flags());
+	rc = dsa_submit(c, &desc, &job->comp[slot], NULL);
+	if (rc)
+		copy_unmap(job, ch);
+
+	return rc;
+}
+
+/*
+ * Backs off after dsa_submit() gave up on a WQ that other submitters keep full.
+ * since is 0 at the first rejection; returns false once they have lasted
+ * dsa_comp_timeout_ns().
+ */
+static bool copy_backoff(u64 *since)
+{
+	u64 now = ktime_get_ns();
+
+	if (!*since)
+		*since = now;
+	else if (now - *since > dsa_comp_timeout_ns())
+		return false;
+
+	usleep_range(COPY_BACKOFF_US, COPY_BACKOFF_US * 2);
+	return true;
+}
+
+// Drains every channel; returns 0 once none of the chunks can still land
+static int copy_drain(struct copy_job *job)
+{
+	int i, rc = 0;
+
+	for (i = 0; i < job->nr_chan; i++)
+		if (chan_drain(job->chans[i]))
+			rc = -ETIMEDOUT;
+
+	return rc;
+}
+
+/*
+ * Copies len bytes from src to dst. The range is split into chunks that fit
+ * the channels' max_xfer, the chunks are handed to the channels round-robin,
+ * and the call returns once all of them have completed. Both buffers must be
+ * physically contiguous kernel memory, e.g. from alloc_pages() or a huge page.
+ * Only WQs that other submitters keep full for dsa_comp_timeout_ns() fail
+ * the copy with -EAGAIN.
+ */
+int dsa_copy_bulk(struct dsa_chan **chans, int nr_chan, void *dst, const void *src, size_t len)
+{
+	struct copy_job *job;
+	unsigned int head, tail;
+	size_t size, off;
+	size_t comp_size;
+	struct copy_chunk *ch;
+	u64 busy_since = 0;
+	int slot, i;
+	int rc, err;
+
+	if (!len)
+		return 0;
+	if (nr_chan < 1 || !virt_addr_valid(src) || !virt_addr_valid(src + len - 1) ||
+	    !virt_addr_valid(dst) || !virt_addr_valid(dst + len - 1))
+		return -EINVAL;
+
+	job = kzalloc(struct_size(job, comp_dma, nr_chan), GFP_KERNEL);
+	if (!job)
+		return -ENOMEM;
+	job->chans = chans;
+	job->nr_chan = nr_chan;
+
+	comp_size = COPY_WINDOW * sizeof(struct dsa_completion_record);
+	job->comp = alloc_pages_exact(comp_size, GFP_KERNEL | __GFP_ZERO);
+	if (!job->comp) {
+		kfree(job);
+		return -ENOMEM;
+	}
+	for (i = 0; i < nr_chan; i++)
+		job->comp_dma[i] = chan_map(chans[i], job->comp, comp_size);
+
+	size = copy_chunk_size(chans, nr_chan, len);
+	head = tail = 0;
+	off = 0;
+	err = 0;
+
+	while (head != tail || (off < len && !err)) {
+		// Fill the window
+		while (off < len && !err && tail - head < COPY_WINDOW) {
+			slot = tail % COPY_WINDOW;
+			ch = &job->chunk[slot];
+			ch->idx = tail % nr_chan;
+			ch->len = min(size, len - off);
+
+			rc = copy_submit(job, ch, slot, dst + off, src + off);
+			if (rc == -EAGAIN) {
+				// Reaping our oldest chunk makes room; otherwise others fill the WQ
+				if (head != tail)
+					break;
+				if (copy_backoff(&busy_since))
+					continue;
+			}
+			if (rc) {
+				err = rc;
+				break;
+			}
+
+			busy_since = 0;
+			off += ch->len;
+			tail++;
+		}
+
+		if (head == tail)
+			continue;
+
+		// Reap the oldest chunk
+		slot = head % COPY_WINDOW;
+		ch = &job->chunk[slot];
+		rc = dsa_poll(job->chans[ch->idx], &job->comp[slot]);
+		if (unlikely(rc < 0)) {
+			if (copy_drain(job)) {
+				// The device may still write; leave everything in place
+				printk("kdsa: bulk copy stalled, leaking %zu bytes of records\n", comp_size);
+				return -ETIMEDOUT;
+			}
+			rc = peek(&job->comp[slot]);
+		}
+		if (unlikely(rc != DSA_COMP_SUCCESS) && !err)
+			err = rc ? -EIO : -ETIMEDOUT;
+
+		job->comp[slot].status = 0;
+		copy_unmap(job, ch);
+		head++;
+	}
+
+	for (i = 0; i < nr_chan; i++)
+		chan_unmap(chans[i], job->comp_dma[i], comp_size);
+	free_pages_exact(job->comp, comp_size);
+	kfree(job);
+
+	return err;
+}
+EXPORT_SYMBOL_GPL(dsa_copy_bulk);
+
+/*
+ * In-flight batches of dsa_copy_sg(). Every batch owns a descriptor list of
+ * max_batch entries and one completion record; a batch of a single
+ * descriptor is submitted on its own and uses the same record.
+ */
+struct copy_sg_job {
+	struct dsa_chan *c;
+	u32 max_batch;
+
+	void *arena;
+	size_t arena_size;
+	dma_addr_t arena_dma;
+
+	struct dsa_hw_desc *desc;		// COPY_SG_DEPTH lists of max_batch
+	struct dsa_completion_record *comp;	// COPY_SG_DEPTH records
+	u32 count[COPY_SG_DEPTH];
+};
+
+static dma_addr_t copy_sg_desc_dma(struct copy_sg_job *job, int k)
+{
+	return job->arena_dma + k * job->max_batch * sizeof(struct dsa_hw_desc);
+}
+
+static dma_addr_t copy_sg_comp_dma(struct copy_sg_job *job, int k)
+{
+	return job->arena_dma + (void *)&job->comp[k] - job->arena;
+}
+
+static int copy_sg_submit(struct copy_sg_job *job, int k)
+{
+	struct dsa_hw_desc batch_desc;
+
+	if (job->count[k] == 1) {
+		job->desc[k * job->max_batch].flags = dsa_comp_flags();
+		job->desc[k * job->max_batch].completion_addr = copy_sg_comp_dma(job, k);
+		return dsa_submit(job->c, &job->desc[k * job->max_batch], &job->comp[k], NULL);
+	}
+
+	dsa_prep(&batch_desc, DSA_OPCODE_BATCH, copy_sg_desc_dma(job, k), 0, job->count[k],
+	         copy_sg_comp_dma(job, k), dsa_comp_flags());
+	return dsa_submit(job->c, &batch_desc, &job->comp[k], NULL);
+}
+
+// Returns 0, -EIO if a descriptor failed, or -ETIMEDOUT if the WQ is stuck
+static int copy_sg_reap(struct copy_sg_job *job, int k)
+{
+	int rc;
+
+	rc = dsa_poll(job->c, &job->comp[k]);
+	if (unlikely(rc < 0)) {
+		if (chan_drain(job->c))
+			return -ETIMEDOUT;
+		rc = peek(&job->comp[k]);
+	}
+	job->comp[k].status = 0;
+
+	if (rc == DSA_COMP_SUCCESS)
+		return 0;
+	return rc ? -EIO : -ETIMEDOUT;
+}
+
+/*
+ * Copies the segments of src to those of dst, which must cover the same
+ * number of bytes but may be split differently. Both tables are mapped for
+ * the channel, every overlap of a source and a destination segment becomes a
+ * MEMMOVE descriptor, and up to max_batch of them go out as one BATCH. A full
+ * WQ fails the copy with -EAGAIN only as in dsa_copy_bulk().
+ */
+int dsa_copy_sg(struct dsa_chan *c, struct sg_table *dst, struct sg_table *src)
+{
+	struct scatterlist *ssg, *dsg;
+	struct copy_sg_job job = { .c = c };
+	struct dsa_hw_desc *desc;
+	unsigned int soff, doff;
+	unsigned int sleft, dleft;	// DMA segments left
+	unsigned int head, tail;
+	size_t slen, dlen;
+	u64 busy_since;
+	u32 len;
+	int i, k;
+	int rc, err;
+
+	slen = dlen = 0;
+	for_each_sgtable_sg(src, ssg, i)
+		slen += ssg->length;
+	for_each_sgtable_sg(dst, dsg, i)
+		dlen += dsg->length;
+	if (slen != dlen)
+		return -EINVAL;
+	if (!slen)
+		return 0;
+
+	// Without BATCH support every descriptor is submitted on its own
+	job.max_batch = clamp_t(u32, c->max_batch, 1, COPY_SG_MAX_BATCH);
+	job.arena_size = COPY_SG_DEPTH * (job.max_batch * sizeof(struct dsa_hw_desc) +
+					  sizeof(struct dsa_completion_record));
+	job.arena = alloc_pages_exact(job.arena_size, GFP_KERNEL | __GFP_ZERO);
+	if (!job.arena)
+		return -ENOMEM;
+	job.desc = job.arena;
+	job.comp = (void *)&job.desc[COPY_SG_DEPTH * job.max_batch];
+
+	rc = chan_map_sg(c, src);
+	if (rc)
+		goto out_free;
+	rc = chan_map_sg(c, dst);
+	if (rc)
+		goto out_unmap_src;
+	job.arena_dma = chan_map(c, job.arena, job.arena_size);
+
+	ssg = src->sgl;
+	dsg = dst->sgl;
+	sleft = src->nents;
+	dleft = dst->nents;
+	soff = doff = 0;
+	head = tail = 0;
+	err = 0;
+
+	while (sleft && dleft && !err) {
+		// Fill the next batch from the segments left
+		k = tail % COPY_SG_DEPTH;
+		desc = &job.desc[k * job.max_batch];
+		job.count[k] = 0;
+
+		while (sleft && dleft && job.count[k] < job.max_batch) {
+			len = min3((u64)sg_dma_len(ssg) - soff, (u64)sg_dma_len(dsg) - doff, c->max_xfer);
+			dsa_prep(&desc[job.count[k]++], DSA_OPCODE_MEMMOVE,
+			         sg_dma_address(ssg) + soff, sg_dma_address(dsg) + doff, len, 0, 0);
+
+			soff += len;
+			if (soff == sg_dma_len(ssg) && --sleft) {
+				ssg = sg_next(ssg);
+				soff = 0;
+			}
+			doff += len;
+			if (doff == sg_dma_len(dsg) && --dleft) {
+				dsg = sg_next(dsg);
+				doff = 0;
+			}
+		}
+
+		// On a full WQ, reap our oldest batch to make room, or wait for others
+		busy_since = 0;
+		while ((err = copy_sg_submit(&job, k)) == -EAGAIN) {
+			if (head == tail) {
+				if (!copy_backoff(&busy_since))
+					break;
+				continue;
+			}
+
+			err = copy_sg_reap(&job, head % COPY_SG_DEPTH);
+			if (err == -ETIMEDOUT)
+				goto stalled;
+			head++;
+			if (err)
+				break;
+		}
+		if (err)
+			break;
+		tail++;
+
+		if (tail - head == COPY_SG_DEPTH) {
+			err = copy_sg_reap(&job, head % COPY_SG_DEPTH);
+			if (err == -ETIMEDOUT)
+				goto stalled;
+			head++;
+		}
+	}
+
+	while (head != tail) {
+		rc = copy_sg_reap(&job, head % COPY_SG_DEPTH);
+		if (rc == -ETIMEDOUT)
+			goto stalled;
+		if (rc && !err)
+			err = rc;
+		head++;
+	}
+
+	chan_unmap(c, job.arena_dma, job.arena_size);
+	chan_unmap_sg(c, dst);
+	chan_unmap_sg(c, src);
+	free_pages_exact(job.arena, job.arena_size);
+
+	return err;
+
+stalled:
+	// The device may still write; leave everything in place
+	printk("kdsa: sg copy stalled on %s, leaking %zu bytes of descriptors\n", c->name, job.arena_size);
+	return -ETIMEDOUT;
+
+out_unmap_src:
+	chan_unmap_sg(c, src);
+out_free:
+	free_pages_exact(job.arena, job.arena_size);
+
+	return rc;
+}
+EXPORT_SYMBOL_GPL(dsa_copy_sg);
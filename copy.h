@@ -0,0 +1,9 @@
+#ifndef _COPY_H_
+#define _COPY_H_
+
+#include "driver.h"
+
+int dsa_copy_bulk(struct dsa_chan **chans, int nr_chan, void *dst, const void *src, size_t len);
+int dsa_copy_sg(struct dsa_chan *c, struct sg_table *dst, struct sg_table *src);
+
+#endif
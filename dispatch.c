@@ -0,0 +1,331 @@
+#include "dispatch.h"
+
+#include <linux/export.h>
+#include <linux/ktime.h>
+#include <linux/minmax.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#define DISPATCH_MAX_DESC	(16)	// DSA chunks of one copy
+#define DISPATCH_SHARE_ALL	(1024)	// dsa_share of a copy done by DSA alone
+
+// Calibration
+#define CALIB_MIN_SIZE		(256)
+#define CALIB_MAX_SIZE		(SZ_2M)
+#define CALIB_NR_SIZE		(14)	// CALIB_MIN_SIZE << 13 == CALIB_MAX_SIZE
+#define CALIB_ITER		(32)
+
+static unsigned int crossover;
+module_param(crossover, uint, 0644);
+MODULE_PARM_DESC(crossover, "Smallest copy offloaded to DSA, overriding calibration unless 0 (default 0)");
+
+static unsigned int split_size;
+module_param(split_size, uint, 0644);
+MODULE_PARM_DESC(split_size, "Smallest copy split between the CPU and DSA, overriding calibration unless 0 (default 0)");
+
+static unsigned int dsa_share;
+module_param(dsa_share, uint, 0644);
+MODULE_PARM_DESC(dsa_share, "Share of a split copy done by DSA in 1/1024ths, overriding calibration unless 0 (default 0)");
+
+struct dispatch {
+	struct dsa_chan **chans;
+	int nr_chan;
+	int node;
+	bool stalled;	// records leaked to a stuck WQ; DSA is off
+	struct dispatch_params p;
+
+	u64 max_xfer;
+	struct {
+		int idx;	// channel
+		dma_addr_t src, dst;
+		size_t len;
+	} chunk[DISPATCH_MAX_DESC];
+
+	// One record per chunk, mapped for every channel
+	struct dsa_completion_record *comp;
+	dma_addr_t comp_dma[];
+};
+
+#define COMP_SIZE	(DISPATCH_MAX_DESC * sizeof(struct dsa_completion_record))
+
+struct dispatch *dsa_dispatch_create(struct dsa_chan **chans, int nr_chan, int node,
+		const struct dispatch_params *params)
+{
+	struct dispatch *d;
+	int i;
+
+	d = kzalloc_node(struct_size(d, comp_dma, nr_chan), GFP_KERNEL, node);
+	if (!d)
+		return NULL;
+	d->chans = chans;
+	d->nr_chan = nr_chan;
+	d->node = node;
+
+	if (params)
+		d->p = *params;
+	if (crossover)
+		d->p.crossover = crossover;
+	if (split_size)
+		d->p.split_size = split_size;
+	if (dsa_share)
+		d->p.dsa_share = dsa_share;
+
+	d->comp = alloc_pages_exact_nid(node, COMP_SIZE, GFP_KERNEL | __GFP_ZERO);
+	if (!d->comp) {
+		kfree(d);
+		return NULL;
+	}
+
+	d->max_xfer = chans[0]->max_xfer;
+	for (i = 0; i < nr_chan; i++) {
+		d->max_xfer = min(d->max_xfer, chans[i]->max_xfer);
+		d->comp_dma[i] = chan_map(chans[i], d->comp, COMP_SIZE);
+	}
+
+	return d;
+}
+EXPORT_SYMBOL_GPL(dsa_dispatch_create);
+
+void dsa_dispatch_destroy(struct dispatch *d)
+{
+	int i;
+
+	if (!d)
+		return;
+
+	// The device may still write the records; leak them
+	if (!d->stalled) {
+		for (i = 0; i < d->nr_chan; i++)
+			chan_unmap(d->chans[i], d->comp_dma[i], COMP_SIZE);
+		free_pages_exact(d->comp, COMP_SIZE);
+	}
+	kfree(d);
+}
+EXPORT_SYMBOL_GPL(dsa_dispatch_destroy);
+
+static bool dispatch_dma_ok(const void *addr, size_t len)
+{
+	return virt_addr_valid(addr) && virt_addr_valid(addr + len - 1);
+}
+
+// Submits the first len bytes as up to DISPATCH_MAX_DESC chunks; returns the chunk count
+static int dispatch_submit(struct dispatch *d, void *dst, const void *src, size_t len)
+{
+	struct dsa_hw_desc desc;
+	struct dsa_chan *c;
+	size_t size, off;
+	int n, rc;
+
+	// A chunk per channel, unless that makes them smaller than crossover
+	size = max_t(size_t, DIV_ROUND_UP(len, d->nr_chan), d->p.crossover);
+	size = min_t(u64, size, d->max_xfer);
+
+	for (n = 0, off = 0; off < len && n < DISPATCH_MAX_DESC; n++, off += size) {
+		d->chunk[n].idx = n % d->nr_chan;
+		d->chunk[n].len = min(size, len - off);
+
+		c = d->chans[d->chunk[n].idx];
+		d->chunk[n].src = chan_map(c, (void *)src + off, d->chunk[n].len);
+		d->chunk[n].dst = chan_map(c, dst + off, d->chunk[n].len);
+
+		dsa_prep(&desc, DSA_OPCODE_MEMMOVE, d->chunk[n].src, d->chunk[n].dst, d->chunk[n].len,
+		         d->comp_dma[d->chunk[n].idx] + n * sizeof(struct dsa_completion_record), dsa_comp_flags());
+		rc = dsa_submit(c, &desc, &d->comp[n], NULL);
+		if (rc) {
+			chan_unmap(c, d->chunk[n].src, d->chunk[n].len);
+			chan_unmap(c, d->chunk[n].dst, d->chunk[n].len);
+			break;
+		}
+	}
+
+	return n;
+}
+
+// Returns 0, -EIO if a chunk failed, or -ETIMEDOUT if a WQ is stuck
+static int dispatch_reap(struct dispatch *d, int n)
+{
+	struct dsa_chan *c;
+	int i, k;
+	int rc, err = 0;
+
+	for (i = 0; i < n; i++) {
+		c = d->chans[d->chunk[i].idx];
+
+		rc = dsa_poll(c, &d->comp[i]);
+		if (unlikely(rc < 0)) {
+			for (k = 0; k < d->nr_chan; k++) {
+				if (chan_drain(d->chans[k])) {
+					printk("kdsa: hybrid copy stalled on %s, DSA disabled\n", d->chans[k]->name);
+					d->stalled = true;
+					return -ETIMEDOUT;
+				}
+			}
+			rc = peek(&d->comp[i]);
+		}
+		if (unlikely(rc != DSA_COMP_SUCCESS) && !err)
+			err = rc ? -EIO : -ETIMEDOUT;
+
+		d->comp[i].status = 0;
+		chan_unmap(c, d->chunk[i].src, d->chunk[i].len);
+		chan_unmap(c, d->chunk[i].dst, d->chunk[i].len);
+	}
+
+	return err;
+}
+
+/*
+ * DSA takes its share from the front of the copy, the CPU copies the rest
+ * while the descriptors run, and the call returns once both are done. A
+ * share of DISPATCH_SHARE_ALL leaves nothing to the CPU.
+ */
+static int dispatch_split(struct dispatch *d, void *dst, const void *src, size_t len, unsigned int share)
+{
+	size_t dsa_len;
+	int n, i, err;
+
+	dsa_len = min_t(u64, div_u64((u64)len * share, DISPATCH_SHARE_ALL), d->max_xfer * DISPATCH_MAX_DESC);
+	dsa_len = round_down(dsa_len, PAGE_SIZE) ?: dsa_len;
+
+	n = dispatch_submit(d, dst, src, dsa_len);
+	if (!n) {
+		memcpy(dst, src, len);
+		return 0;
+	}
+
+	// Whatever did not fit in the chunks is left to the CPU as well
+	for (i = 0, dsa_len = 0; i < n; i++)
+		dsa_len += d->chunk[i].len;
+
+	// The kernel's memcpy() is rep movsb on ERMS/FSRM parts
+	memcpy(dst + dsa_len, src + dsa_len, len - dsa_len);
+
+	err = dispatch_reap(d, n);
+	if (err == -EIO) {
+		// Redo DSA's part on the CPU rather than fail the copy
+		memcpy(dst, src, dsa_len);
+		err = 0;
+	}
+
+	return err;
+}
+
+/*
+ * Copies len bytes from src to dst. Copies shorter than crossover, or whose
+ * buffers DSA cannot map, are done by memcpy(); longer ones are offloaded,
+ * and from split_size on, the CPU copies the part DSA is not given.
+ */
+int dsa_dispatch_copy(struct dispatch *d, void *dst, const void *src, size_t len)
+{
+	if (!len || len < d->p.crossover || d->stalled || !dispatch_dma_ok(src, len) || !dispatch_dma_ok(dst, len)) {
+		memcpy(dst, src, len);
+		return 0;
+	}
+
+	return dispatch_split(d, dst, src, len, len >= d->p.split_size ? d->p.dsa_share : DISPATCH_SHARE_ALL);
+}
+EXPORT_SYMBOL_GPL(dsa_dispatch_copy);
+
+// Average ns per copy of size bytes; share 0 times the CPU alone
+static u64 calib_time(struct dispatch *d, void *dst, const void *src, size_t size, unsigned int share)
+{
+	u64 start;
+	int i;
+
+	// Warm up the caches, the IOTLB and the WQ
+	if (share)
+		dispatch_split(d, dst, src, size, share);
+	else
+		memcpy(dst, src, size);
+
+	start = ktime_get_ns();
+	for (i = 0; i < CALIB_ITER; i++) {
+		if (!share)
+			memcpy(dst, src, size);
+		else if (dispatch_split(d, dst, src, size, share))
+			return U64_MAX;
+	}
+
+	return div_u64(ktime_get_ns() - start, CALIB_ITER);
+}
+
+/*
+ * Times the CPU, DSA alone and a split copy at every power of two from
+ * CALIB_MIN_SIZE to CALIB_MAX_SIZE and sets the thresholds that are 0:
+ * crossover is the smallest size DSA wins at, dsa_share balances the two
+ * bandwidths at the largest size, and split_size is the smallest size the
+ * split wins at.
+ */
+int dsa_dispatch_calibrate(struct dispatch *d)
+{
+	u64 t_cpu[CALIB_NR_SIZE], t_dsa[CALIB_NR_SIZE], t_split;
+	void *src, *dst;
+	size_t size;
+	int i, last;
+
+	src = alloc_pages_exact_nid(d->node, CALIB_MAX_SIZE, GFP_KERNEL | __GFP_NOWARN);
+	dst = alloc_pages_exact_nid(d->node, CALIB_MAX_SIZE, GFP_KERNEL | __GFP_NOWARN);
+	if (!src || !dst) {
+		printk("kdsa: failed to allocate the calibration buffers\n");
+		goto failure;
+	}
+	memset(src, 0x5a, CALIB_MAX_SIZE);
+
+	for (i = 0, size = CALIB_MIN_SIZE; i < CALIB_NR_SIZE; i++, size <<= 1) {
+		t_cpu[i] = calib_time(d, dst, src, size, 0);
+		t_dsa[i] = calib_time(d, dst, src, size, DISPATCH_SHARE_ALL);
+		if (d->stalled)
+			goto failure;
+	}
+	last = CALIB_NR_SIZE - 1;
+
+	if (!d->p.crossover) {
+		d->p.crossover = UINT_MAX;
+		for (i = 0, size = CALIB_MIN_SIZE; i < CALIB_NR_SIZE; i++, size <<= 1) {
+			if (t_dsa[i] < t_cpu[i]) {
+				d->p.crossover = size;
+				break;
+			}
+		}
+	}
+
+	// Both run at once, so each gets a share proportional to its bandwidth
+	if (!d->p.dsa_share)
+		d->p.dsa_share = clamp_t(u64, div64_u64((u64)DISPATCH_SHARE_ALL * t_cpu[last], t_cpu[last] + t_dsa[last]),
+				    1, DISPATCH_SHARE_ALL);
+
+	for (i = 0, size = CALIB_MIN_SIZE; i < CALIB_NR_SIZE; i++, size <<= 1) {
+		t_split = size >= d->p.crossover ? calib_time(d, dst, src, size, d->p.dsa_share) : U64_MAX;
+		if (d->stalled)
+			goto failure;
+
+		printk("kdsa: hybrid:     %8zu B  cpu %llu ns, dsa %llu ns, split %lld ns\n",
+				size, t_cpu[i], t_dsa[i], t_split == U64_MAX ? -1LL : (s64)t_split);
+		if (!d->p.split_size && t_split < t_dsa[i])
+			d->p.split_size = size;
+	}
+	if (!d->p.split_size)
+		d->p.split_size = UINT_MAX;
+
+	printk("kdsa: hybrid:     node %d, crossover %u B, split from %u B, dsa share %u/%u\n",
+			d->node, d->p.crossover, d->p.split_size, d->p.dsa_share, DISPATCH_SHARE_ALL);
+
+	free_pages_exact(src, CALIB_MAX_SIZE);
+	free_pages_exact(dst, CALIB_MAX_SIZE);
+	return 0;
+
+failure:
+	// A stalled WQ may still write dst
+	if (src)
+		free_pages_exact(src, CALIB_MAX_SIZE);
+	if (dst && !d->stalled)
+		free_pages_exact(dst, CALIB_MAX_SIZE);
+	return 1;
+}
+EXPORT_SYMBOL_GPL(dsa_dispatch_calibrate);
+
+const struct dispatch_params *dsa_dispatch_params(struct dispatch *d)
+{
+	return &d->p;
+}
+EXPORT_SYMBOL_GPL(dsa_dispatch_params);
@@ -0,0 +1,30 @@
+#ifndef _DISPATCH_H_
+#define _DISPATCH_H_
+
+#include "driver.h"
+
+/*
+ * Routes every copy to the CPU or to DSA by size, and splits large copies
+ * between both. Every dispatcher keeps its own thresholds: those given to
+ * dsa_dispatch_create(), with the crossover, split_size and dsa_share
+ * parameters overriding them, and dsa_dispatch_calibrate() filling in the
+ * ones still 0.
+ */
+struct dispatch;
+
+struct dispatch_params {
+	unsigned int crossover;		// smallest copy offloaded to DSA
+	unsigned int split_size;	// smallest copy split between the CPU and DSA
+	unsigned int dsa_share;		// DSA's part of a split copy, in 1/1024ths
+};
+
+// params, if not NULL, are thresholds calibrated earlier on node
+struct dispatch *dsa_dispatch_create(struct dsa_chan **chans, int nr_chan, int node,
+		const struct dispatch_params *params);
+void dsa_dispatch_destroy(struct dispatch *d);
+
+int dsa_dispatch_calibrate(struct dispatch *d);
+const struct dispatch_params *dsa_dispatch_params(struct dispatch *d);
+int dsa_dispatch_copy(struct dispatch *d, void *dst, const void *src, size_t len);
+
+#endif
@@ -1,44 +1,441 @@
 #include "driver.h"
 
+#include <asm/cpufeature.h>
+#include <asm/msr.h>
 #include <asm/processor.h>
+#include <linux/delay.h>
+#include <linux/dma-mapping.h>
+#include <linux/export.h>
+#include <linux/ktime.h>
+#include <linux/moduleparam.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/wait_bit.h>
 
-#define WQ_DEDICATED	(0)
-#define COMP_RETRIES	(200000)
+#define DISCOVER_MAX_DEV	(64)
 
-int idxd_enqcmds(struct idxd_wq *wq, void __iomem *portal, const void *desc)
+#define UMWAIT_CYCLES	(10000)	// deadline of a single UMWAIT
+#define UMWAIT_C01	(1)	// light C0.1 state for a faster wakeup
+
+#define RETRY_SPIN		(8)	// attempts separated by cpu_relax()
+#define RETRY_BACKOFF		(8)	// attempts separated by exponential delays
+#define RETRY_BACKOFF_NS	(64)
+#define RETRY_BACKOFF_MAX_NS	(8192)
+#define RETRY_SLEEP_NS		(4096)	// longer delays sleep instead of spinning
+
+enum retry_policy {
+	RETRY_POLICY_SPIN = 0,
+	RETRY_POLICY_BACKOFF,
+	RETRY_POLICY_YIELD,
+	RETRY_POLICY_ADAPTIVE,
+};
+
+static int retry_policy = RETRY_POLICY_SPIN;
+module_param(retry_policy, int, 0644);
+MODULE_PARM_DESC(retry_policy, "Rejected ENQCMDS retry policy: 0 spin, 1 backoff, 2 yield, 3 spin then backoff then yield (default 0)");
+
+static unsigned int retry_limit;
+module_param(retry_limit, uint, 0644);
+MODULE_PARM_DESC(retry_limit, "Retries of a rejected ENQCMDS before dsa_submit() gives up with -EAGAIN, 0 for the WQ's enqcmds_retries (default 0)");
+
+enum comp_mode {
+	COMP_MODE_SPIN = 0,
+	COMP_MODE_UMWAIT,
+	COMP_MODE_IRQ,
+};
+
+// Read at every submission and wait, so a sweep changes it between runs
+static int comp_mode = COMP_MODE_SPIN;
+module_param(comp_mode, int, 0644);
+MODULE_PARM_DESC(comp_mode, "Completion wait: 0 busy poll, 1 UMONITOR/UMWAIT, 2 completion interrupt (default 0)");
+
+static unsigned int comp_timeout_ms = 1000;
+module_param(comp_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(comp_timeout_ms, "Time to wait for a completion record before the WQ is drained (default 1000)");
+
+static int submit_desc(struct idxd_wq *wq, struct dsa_hw_desc *desc, bool dedicated)
+{
+	void __iomem *portal;
+
+	portal = idxd_wq_portal_addr(wq);
+
+	if (dedicated) {
+		// Dedicated WQs
+		movdir64b(portal, desc);
+		return 0;
+	}
+
+	// Shared WQs; retries are up to dsa_submit()
+	return enqcmds(portal, desc);
+}
+
+// Waiter of a descriptor submitted with a completion interrupt
+struct dsa_irq_comp {
+	struct dsa_chan *c;
+	struct idxd_desc *desc;
+	struct dsa_completion_record *comp;
+};
+
+// Runs in the idxd interrupt thread once the device wrote desc's record
+static void hw_irq_done(void *param, const struct dmaengine_result *res)
+{
+	struct dsa_irq_comp *irq = param;
+	struct dsa_completion_record *rec = irq->desc->completion;
+	struct dsa_chan *c = irq->c;
+	u8 status = rec->status;
+
+	// A descriptor the driver aborted has no record
+	if (!status)
+		status = IDXD_COMP_DESC_ABORT;
+
+	// The status byte goes last, as the device writes it
+	memcpy((u8 *)irq->comp + 1, (u8 *)rec + 1, sizeof(*rec) - 1);
+	smp_wmb();
+	WRITE_ONCE(irq->comp->status, status);
+
+	smp_mb();
+	wake_up_var(irq->comp);
+
+	if (atomic_dec_and_test(&c->irq_inflight))
+		wake_up_var(&c->irq_inflight);
+}
+
+/*
+ * The WQ's MSI-X vector belongs to the idxd driver, whose interrupt thread
+ * only completes its own software descriptors. A descriptor that requests an
+ * interrupt therefore takes the place of the hardware descriptor of a
+ * dmaengine transaction and writes that transaction's record, which the
+ * callback copies to comp.
+ */
+static int hw_submit_irq(struct dsa_chan *c, struct dsa_hw_desc *desc, struct dsa_completion_record *comp)
+{
+	struct dma_async_tx_descriptor *tx;
+	struct dsa_irq_comp *irq;
+	struct idxd_desc *d;
+	dma_cookie_t cookie;
+
+	// No free software descriptor is as good as a full WQ
+	tx = dmaengine_prep_dma_memcpy(c->chan, 0, 0, 0, DMA_PREP_INTERRUPT);
+	if (!tx)
+		return -EAGAIN;
+
+	d = container_of(tx, struct idxd_desc, txd);
+	*d->hw = *desc;
+	d->hw->completion_addr = d->compl_dma;
+
+	irq = &c->irq_comp[d->id];
+	irq->desc = d;
+	irq->comp = comp;
+	tx->callback_result = hw_irq_done;
+	tx->callback_param = irq;
+
+	// idxd sets the interrupt handle and frees d if the submission fails
+	atomic_inc(&c->irq_inflight);
+	cookie = dmaengine_submit(tx);
+	if (dma_submit_error(cookie)) {
+		atomic_dec(&c->irq_inflight);
+		return cookie;
+	}
+	dma_async_issue_pending(c->chan);
+
+	return 0;
+}
+
+static int hw_submit(struct dsa_chan *c, struct dsa_hw_desc *desc, struct dsa_completion_record *comp)
+{
+	struct idxd_wq *wq = to_idxd_wq(c->chan);
+	struct idxd_device *idxd = wq->idxd;
+
+	if (device_pasid_enabled(idxd))
+		desc->pasid = idxd->pasid;
+
+	if (desc->flags & IDXD_OP_FLAG_RCI)
+		return hw_submit_irq(c, desc, comp);
+
+	return submit_desc(wq, desc, c->dedicated);
+}
+
+static dma_addr_t hw_map(struct dsa_chan *c, void *addr, size_t len)
+{
+	return dma_map_single(c->chan->device->dev, addr, len, DMA_BIDIRECTIONAL);
+}
+
+static void hw_unmap(struct dsa_chan *c, dma_addr_t addr, size_t len)
+{
+	dma_unmap_single(c->chan->device->dev, addr, len, DMA_BIDIRECTIONAL);
+}
+
+static dma_addr_t hw_map_resource(struct dsa_chan *c, phys_addr_t phys, size_t len)
+{
+	return dma_map_resource(c->chan->device->dev, phys, len, DMA_BIDIRECTIONAL, 0);
+}
+
+static void hw_unmap_resource(struct dsa_chan *c, dma_addr_t addr, size_t len)
+{
+	dma_unmap_resource(c->chan->device->dev, addr, len, DMA_BIDIRECTIONAL, 0);
+}
+
+static int hw_map_sg(struct dsa_chan *c, struct sg_table *sgt)
 {
-	unsigned int retries = wq->enqcmds_retries;
+	return dma_map_sgtable(c->chan->device->dev, sgt, DMA_BIDIRECTIONAL, 0);
+}
+
+static void hw_unmap_sg(struct dsa_chan *c, struct sg_table *sgt)
+{
+	dma_unmap_sgtable(c->chan->device->dev, sgt, DMA_BIDIRECTIONAL, 0);
+}
+
+/*
+ * A Drain descriptor completes only after all descriptors submitted to the WQ
+ * before it, so its completion confirms that none of them is still running.
+ */
+static int hw_drain(struct dsa_chan *c)
+{
+	struct dsa_completion_record *comp;
+	struct dsa_hw_desc desc;
+	dma_addr_t comp_dma;
 	int rc;
 
-	do {
-		rc = enqcmds(portal, desc);
-		if (rc == 0)
-			break;
-		cpu_relax();
-	} while (retries--);
+	// A 32-byte kmalloc() object is 32-byte aligned
+	comp = kzalloc(sizeof(*comp), GFP_KERNEL);
+	if (!comp)
+		return -ENOMEM;
+	comp_dma = hw_map(c, comp, sizeof(*comp));
+
+	dsa_prep(&desc, DSA_OPCODE_DRAIN, 0, 0, 0, comp_dma, IDXD_OP_FLAG_RCR | IDXD_OP_FLAG_CRAV);
+	rc = dsa_submit(c, &desc, NULL, NULL);
+	if (!rc) {
+		rc = dsa_poll(c, comp);
+		if (rc == -ETIMEDOUT) {
+			// The device may still write the record
+			printk("kdsa: %s: drain timed out\n", c->name);
+			return rc;
+		}
+		rc = rc == DSA_COMP_SUCCESS ? 0 : -EIO;
+	}
+
+	/*
+	 * Records of interrupt descriptors are copied by their callbacks, which
+	 * may still be pending. Other submitters on the channel can hold this up
+	 * for as long as they keep descriptors in flight.
+	 */
+	if (!rc && !wait_var_event_timeout(&c->irq_inflight, !atomic_read(&c->irq_inflight),
+					   msecs_to_jiffies(comp_timeout_ms))) {
+		printk("kdsa: %s: drain timed out on completion callbacks\n", c->name);
+		rc = -ETIMEDOUT;
+	}
 
+	hw_unmap(c, comp_dma, sizeof(*comp));
+	kfree(comp);
 	return rc;
 }
 
-static int submit_desc(struct idxd_wq *wq, struct dsa_hw_desc *desc)
+static void hw_release(struct dsa_chan *c)
 {
-	void __iomem *portal;
+	dma_release_channel(c->chan);
+	kfree(c->irq_comp);
+	kfree(c);
+}
 
-	portal = idxd_wq_portal_addr(wq);
+static const struct dsa_backend hw_backend = {
+	.name = "hw",
+	.submit = hw_submit,
+	.map = hw_map,
+	.unmap = hw_unmap,
+	.map_resource = hw_map_resource,
+	.unmap_resource = hw_unmap_resource,
+	.map_sg = hw_map_sg,
+	.unmap_sg = hw_unmap_sg,
+	.drain = hw_drain,
+	.release = hw_release,
+};
+
+static bool filter(struct dma_chan *chan, void *param)
+{
+	const char *wanted = param;
+	const char *name = dma_chan_name(chan);
+	return strcmp(name, wanted) == 0;
+}
+
+// The WQ mode comes from the idxd configuration (scripts/setup_dsa.sh)
+static int chan_setup(struct dsa_chan *c)
+{
+	struct idxd_wq *wq = to_idxd_wq(c->chan);
+	int i;
+
+	c->irq_comp = kcalloc(wq->num_descs, sizeof(*c->irq_comp), GFP_KERNEL);
+	if (!c->irq_comp)
+		return -ENOMEM;
+	for (i = 0; i < wq->num_descs; i++)
+		c->irq_comp[i].c = c;
+	atomic_set(&c->irq_inflight, 0);
+
+	c->backend = &hw_backend;
+	c->dedicated = wq_dedicated(to_idxd_wq(c->chan));
+	c->dev_id = c->chan->device->dev_id;
+	c->node = dev_to_node(c->chan->device->dev);
+	c->max_xfer = to_idxd_wq(c->chan)->max_xfer_bytes;
+	c->max_batch = to_idxd_wq(c->chan)->max_batch_size;
+	c->wq_size = to_idxd_wq(c->chan)->size;
+	c->cc_cache = to_idxd_wq(c->chan)->idxd->hw.gen_cap.cache_control_cache;
+	memcpy(c->opcap, to_idxd_wq(c->chan)->idxd->hw.opcap.bits, sizeof(c->opcap));
+	strscpy(c->name, dma_chan_name(c->chan), sizeof(c->name));
 
-#if (WQ_DEDICATED == 1)
-	// Dedicated WQs
-	movdir64b(portal, desc);
 	return 0;
-#elif (WQ_DEDICATED == 0)
-	// Shared WQs
-	return idxd_enqcmds(wq, portal, desc);
-#else
-#error Invalid WQ mode
-#endif
 }
 
-void prep(struct dsa_hw_desc *desc, u8 opcode, u64 addr_f1, u64 addr_f2, u64 len, u64 compl, u32 flags)
+/*
+ * The device limits come from the shadow registers the idxd driver read at
+ * probe; a WQ may be configured below them (scripts/setup_dsa.sh).
+ */
+void dsa_chan_report(struct dsa_chan *c, bool dev)
+{
+	struct idxd_hw *hw;
+
+	if (dev && c->chan) {
+		hw = &to_idxd_wq(c->chan)->idxd->hw;
+		printk("kdsa: dev %d:      version %#x, max batch %u, max xfer %llu, %u WQs of %u entries%s%s\n",
+				c->dev_id, hw->version,
+				hw->gen_cap.max_batch_shift ? 1U << hw->gen_cap.max_batch_shift : 0,
+				1ULL << hw->gen_cap.max_xfer_shift,
+				(u32)hw->wq_cap.num_wqs, (u32)hw->wq_cap.total_wq_size,
+				hw->wq_cap.shared_mode ? ", shared" : "",
+				hw->wq_cap.dedicated_mode ? ", dedicated" : "");
+		printk("kdsa: dev %d:      opcap %016llx %016llx %016llx %016llx%s%s%s\n",
+				c->dev_id, c->opcap[3], c->opcap[2], c->opcap[1], c->opcap[0],
+				hw->gen_cap.block_on_fault ? ", block on fault" : "",
+				hw->gen_cap.cache_control_cache ? ", cache control" : "",
+				hw->gen_cap.batch_continuation ? ", batch continuation" : "");
+	}
+
+	printk("kdsa: %-12s %s %s, size %u, max batch %u, max xfer %llu\n",
+			c->name, c->backend->name, c->dedicated ? "dedicated" : "shared",
+			c->wq_size, c->max_batch, c->max_xfer);
+}
+EXPORT_SYMBOL_GPL(dsa_chan_report);
+
+struct dsa_chan *dsa_chan_request(const char *name)
+{
+	dma_cap_mask_t mask;
+	struct dsa_chan *c;
+
+	c = kzalloc(sizeof(*c), GFP_KERNEL);
+	if (!c)
+		return NULL;
+
+	dma_cap_zero(mask);
+	dma_cap_set(DMA_MEMCPY, mask);
+
+	c->chan = dma_request_channel(mask, filter, (void *)name);
+	if (!c->chan) {
+		printk("kdsa: failed to request channel %s\n", name);
+		kfree(c);
+		return NULL;
+	}
+
+	if (chan_setup(c)) {
+		dma_release_channel(c->chan);
+		kfree(c);
+		return NULL;
+	}
+	return c;
+}
+EXPORT_SYMBOL_GPL(dsa_chan_request);
+
+struct discover {
+	struct dma_device *dev[DISCOVER_MAX_DEV];
+	int nr_chan[DISCOVER_MAX_DEV];
+	int nr_dev;
+	int max_dev, max_chan;
+};
+
+static int discover_dev(struct discover *d, struct dma_device *dev)
+{
+	int i;
+
+	for (i = 0; i < d->nr_dev; i++)
+		if (d->dev[i] == dev)
+			return i;
+
+	return -1;
+}
+
+// Accepts idxd channels as long as the limits allow
+static bool filter_idxd(struct dma_chan *chan, void *param)
+{
+	struct discover *d = param;
+	int i;
+
+	if (strcmp(dev_driver_string(chan->device->dev), "idxd") != 0)
+		return false;
+
+	i = discover_dev(d, chan->device);
+	if (i < 0)
+		return d->nr_dev < d->max_dev;
+	return d->nr_chan[i] < d->max_chan;
+}
+
+/*
+ * Requests every free idxd channel, up to max_dev devices and max_chan
+ * channels per device (0 for no limit), and stores at most max of them in
+ * chans. Returns the number of channels found.
+ */
+int dsa_chan_discover(struct dsa_chan **chans, int max, int max_dev, int max_chan)
+{
+	dma_cap_mask_t mask;
+	struct discover *d;
+	struct dsa_chan *c;
+	int n, i;
+
+	d = kzalloc(sizeof(*d), GFP_KERNEL);
+	if (!d)
+		return 0;
+
+	d->max_dev = max_dev ? min(max_dev, DISCOVER_MAX_DEV) : DISCOVER_MAX_DEV;
+	d->max_chan = max_chan ? max_chan : INT_MAX;
+
+	dma_cap_zero(mask);
+	dma_cap_set(DMA_MEMCPY, mask);
+
+	for (n = 0; n < max; n++) {
+		c = kzalloc(sizeof(*c), GFP_KERNEL);
+		if (!c)
+			break;
+
+		c->chan = dma_request_channel(mask, filter_idxd, d);
+		if (!c->chan) {
+			kfree(c);
+			break;
+		}
+
+		if (chan_setup(c)) {
+			dma_release_channel(c->chan);
+			kfree(c);
+			break;
+		}
+
+		i = discover_dev(d, c->chan->device);
+		if (i < 0) {
+			i = d->nr_dev++;
+			d->dev[i] = c->chan->device;
+		}
+		d->nr_chan[i]++;
+
+		chans[n] = c;
+	}
+
+	kfree(d);
+	return n;
+}
+EXPORT_SYMBOL_GPL(dsa_chan_discover);
+
+void dsa_chan_release(struct dsa_chan *c)
+{
+	c->backend->release(c);
+}
+EXPORT_SYMBOL_GPL(dsa_chan_release);
+
+void dsa_prep(struct dsa_hw_desc *desc, u8 opcode, u64 addr_f1, u64 addr_f2, u64 len, u64 compl, u32 flags)
 {
 	memset(desc, 0, sizeof(struct dsa_hw_desc));
 
@@ -50,30 +447,171 @@ void prep(struct dsa_hw_desc *desc, u8 opcode, u64 addr_f1, u64 addr_f2, u64 len
 	desc->priv = 0;
 	desc->completion_addr = compl;
 }
+EXPORT_SYMBOL_GPL(dsa_prep);
 
-int submit(struct dma_chan *c, struct dsa_hw_desc *desc)
+static void submit_backoff(unsigned int retry)
 {
-	struct idxd_wq *wq = to_idxd_wq(c);
-	struct idxd_device *idxd = wq->idxd;
+	unsigned int step, delay;
+	u64 end;
 
-	if (device_pasid_enabled(idxd))
-		desc->pasid = idxd->pasid;
+	switch (retry_policy) {
+	case RETRY_POLICY_BACKOFF:
+		step = min_t(unsigned int, retry, RETRY_BACKOFF);
+		break;
+	case RETRY_POLICY_YIELD:
+		cond_resched();
+		return;
+	case RETRY_POLICY_ADAPTIVE:
+		if (retry < RETRY_SPIN) {
+			cpu_relax();
+			return;
+		}
+		if (retry >= RETRY_SPIN + RETRY_BACKOFF) {
+			cond_resched();
+			return;
+		}
+		step = retry - RETRY_SPIN;
+		break;
+	default:
+		cpu_relax();
+		return;
+	}
+
+	delay = min_t(unsigned int, RETRY_BACKOFF_NS << step, RETRY_BACKOFF_MAX_NS);
+	if (delay >= RETRY_SLEEP_NS) {
+		usleep_range(delay / NSEC_PER_USEC, 2 * delay / NSEC_PER_USEC);
+		return;
+	}
+
+	end = ktime_get_ns() + delay;
+	while (ktime_get_ns() < end)
+		cpu_relax();
+}
+
+// The WQ's limit, which its sysfs enqcmds_retries sets, unless retry_limit overrides it
+static unsigned int submit_retries(struct dsa_chan *c)
+{
+	if (retry_limit)
+		return retry_limit;
+	if (c->chan)
+		return READ_ONCE(to_idxd_wq(c->chan)->enqcmds_retries);
+	return IDXD_ENQCMDS_RETRIES;
+}
+
+int dsa_submit(struct dsa_chan *c, struct dsa_hw_desc *desc, struct dsa_completion_record *comp,
+		struct submit_stats *stats)
+{
+	unsigned int retry, limit;
+	u64 begin;
+	int rc;
+
+	if (comp && comp_mode == COMP_MODE_IRQ)
+		desc->flags |= IDXD_OP_FLAG_RCI;
+
+	rc = c->backend->submit(c, desc, comp);
+	if (likely(rc != -EAGAIN))
+		goto out;
+
+	// The WQ is full; retry according to the policy
+	begin = ktime_get_ns();
+	limit = submit_retries(c);
+	for (retry = 0; retry < limit; retry++) {
+		submit_backoff(retry);
+		if (stats)
+			stats->retries++;
 
-	return submit_desc(wq, desc);
+		rc = c->backend->submit(c, desc, comp);
+		if (rc != -EAGAIN)
+			break;
+	}
+
+	if (stats) {
+		stats->retry_ns += ktime_get_ns() - begin;
+		if (rc == -EAGAIN)
+			stats->rejected++;
+	}
+
+out:
+	if (likely(!rc) && stats)
+		stats->submitted++;
+	return rc;
 }
+EXPORT_SYMBOL_GPL(dsa_submit);
 
-int poll(struct dsa_completion_record *comp)
+static inline void umonitor(volatile void *addr)
 {
-	int retry = 0;
-	volatile uint8_t *status = &comp->status;
+	asm volatile(".byte 0xf3, 0x0f, 0xae, 0xf0" :: "a" (addr) : "memory");
+}
 
-	while (DSA_COMP_STATUS(*status) == 0 && retry++ < COMP_RETRIES)
+static inline void umwait(u32 state, u64 deadline)
+{
+	asm volatile(".byte 0xf2, 0x0f, 0xae, 0xf1"
+		     :: "c" (state), "d" (upper_32_bits(deadline)), "a" (lower_32_bits(deadline))
+		     : "memory");
+}
+
+/*
+ * Completion flags for descriptors whose record is waited on. The completion
+ * interrupt is left to dsa_submit(), so descriptors of a batch never get one.
+ */
+u32 dsa_comp_flags(void)
+{
+	return IDXD_OP_FLAG_RCR | IDXD_OP_FLAG_CRAV;
+}
+EXPORT_SYMBOL_GPL(dsa_comp_flags);
+
+u64 dsa_comp_timeout_ns(void)
+{
+	return (u64)comp_timeout_ms * NSEC_PER_MSEC;
+}
+EXPORT_SYMBOL_GPL(dsa_comp_timeout_ns);
+
+// Waits a little for the record to be written, as selected by comp_mode
+void dsa_comp_wait(struct dsa_chan *c, struct dsa_completion_record *comp)
+{
+	switch (comp_mode) {
+	case COMP_MODE_UMWAIT:
+		if (static_cpu_has(X86_FEATURE_WAITPKG)) {
+			umonitor(&comp->status);
+			if (!peek(comp))
+				umwait(UMWAIT_C01, rdtsc() + UMWAIT_CYCLES);
+			break;
+		}
+		cpu_relax();
+		break;
+	case COMP_MODE_IRQ:
+		// A descriptor submitted without an interrupt is still seen within a jiffy
+		wait_var_event_timeout(comp, peek(comp), 1);
+		break;
+	default:
 		cpu_relax();
+		break;
+	}
+}
+EXPORT_SYMBOL_GPL(dsa_comp_wait);
 
-	return DSA_COMP_STATUS(*status);
+int dsa_poll(struct dsa_chan *c, struct dsa_completion_record *comp)
+{
+	u64 deadline;
+	int rc;
+
+	rc = peek(comp);
+	if (rc)
+		return rc;
+
+	deadline = ktime_get_ns() + dsa_comp_timeout_ns();
+	while (!(rc = peek(comp))) {
+		if (ktime_get_ns() > deadline)
+			return -ETIMEDOUT;
+		dsa_comp_wait(c, comp);
+	}
+
+	return rc;
 }
+EXPORT_SYMBOL_GPL(dsa_poll);
 
-void print_comp(const struct dsa_completion_record *comp)
+void dsa_print_comp(const struct dsa_completion_record *comp)
 {
 	printk("kdsa: comp (status %u, fault_addr %#llx)\n", comp->status, comp->fault_addr);
 }
+EXPORT_SYMBOL_GPL(dsa_print_comp);
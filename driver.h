@@ -3,8 +3,50 @@
 
 #include <asm/page.h>
 #include <linux/dmaengine.h>
+#include <linux/scatterlist.h>
 #include "idxd.h"
 
+struct dsa_chan;
+struct dsa_irq_comp;
+struct emu_wq;
+
+/*
+ * A backend executes the descriptors handed to dsa_submit() and writes their
+ * completion records. The hardware backend pushes them to an idxd WQ portal,
+ * while the emulation backend runs them on the CPU (see emu.c). A descriptor
+ * that requests a completion interrupt wakes the waiters of comp.
+ */
+struct dsa_backend {
+	const char *name;
+	int (*submit)(struct dsa_chan *c, struct dsa_hw_desc *desc, struct dsa_completion_record *comp);
+	dma_addr_t (*map)(struct dsa_chan *c, void *addr, size_t len);
+	void (*unmap)(struct dsa_chan *c, dma_addr_t addr, size_t len);
+	dma_addr_t (*map_resource)(struct dsa_chan *c, phys_addr_t phys, size_t len);
+	void (*unmap_resource)(struct dsa_chan *c, dma_addr_t addr, size_t len);
+	int (*map_sg)(struct dsa_chan *c, struct sg_table *sgt);
+	void (*unmap_sg)(struct dsa_chan *c, struct sg_table *sgt);
+	int (*drain)(struct dsa_chan *c);
+	void (*release)(struct dsa_chan *c);
+};
+
+struct dsa_chan {
+	const struct dsa_backend *backend;
+	char name[16];
+	bool dedicated;
+	int dev_id;		// dmaengine device number
+	int node;		// NUMA node of the device, or NUMA_NO_NODE
+	u64 max_xfer;		// largest transfer size of a descriptor
+	u32 max_batch;		// most descriptors in a BATCH, 0 if unsupported
+	u32 wq_size;		// descriptors the WQ holds
+	bool cc_cache;		// honours cache control (IDXD_OP_FLAG_CC)
+	u64 opcap[4];		// supported opcodes, one bit each
+
+	struct dma_chan *chan;	// hardware backend
+	struct dsa_irq_comp *irq_comp;	// per idxd descriptor, in interrupt mode
+	atomic_t irq_inflight;
+	struct emu_wq *emu;	// emulation backend
+};
+
 static inline struct idxd_wq *to_idxd_wq(struct dma_chan *c)
 {
 	struct idxd_dma_chan *idxd_chan;
@@ -13,9 +55,125 @@ static inline struct idxd_wq *to_idxd_wq(struct dma_chan *c)
 	return idxd_chan->wq;
 }
 
-void prep(struct dsa_hw_desc *desc, u8 opcode, u64 addr_f1, u64 addr_f2, u64 len, u64 compl, u32 flags);
-int submit(struct dma_chan *c, struct dsa_hw_desc *desc);
-int poll(struct dsa_completion_record *comp);
-void print_comp(const struct dsa_completion_record *comp);
+struct dsa_chan *dsa_chan_request(const char *name);
+int dsa_chan_discover(struct dsa_chan **chans, int max, int max_dev, int max_chan);
+void dsa_chan_release(struct dsa_chan *c);
+
+// Prints the limits of the channel, preceded by those of its device if dev
+void dsa_chan_report(struct dsa_chan *c, bool dev);
+
+static inline bool chan_has_op(struct dsa_chan *c, u8 opcode)
+{
+	return c->opcap[opcode / 64] & BIT_ULL(opcode % 64);
+}
+
+static inline dma_addr_t chan_map(struct dsa_chan *c, void *addr, size_t len)
+{
+	return c->backend->map(c, addr, len);
+}
+
+static inline void chan_unmap(struct dsa_chan *c, dma_addr_t addr, size_t len)
+{
+	c->backend->unmap(c, addr, len);
+}
+
+// Whether chan_map() or chan_map_resource() failed to map addr
+static inline bool chan_map_error(struct dsa_chan *c, dma_addr_t addr)
+{
+	if (c->chan)
+		return dma_mapping_error(c->chan->device->dev, addr);
+	return addr == DMA_MAPPING_ERROR;
+}
+
+static inline dma_addr_t chan_map_resource(struct dsa_chan *c, phys_addr_t phys, size_t len)
+{
+	return c->backend->map_resource(c, phys, len);
+}
+
+static inline void chan_unmap_resource(struct dsa_chan *c, dma_addr_t addr, size_t len)
+{
+	c->backend->unmap_resource(c, addr, len);
+}
+
+// Sets sgt->nents to the number of DMA segments; returns 0 or an error
+static inline int chan_map_sg(struct dsa_chan *c, struct sg_table *sgt)
+{
+	return c->backend->map_sg(c, sgt);
+}
+
+static inline void chan_unmap_sg(struct dsa_chan *c, struct sg_table *sgt)
+{
+	c->backend->unmap_sg(c, sgt);
+}
+
+/*
+ * Returns 0 once every descriptor submitted to the channel before the call has
+ * completed or been aborted, so none of their records will be written anymore.
+ */
+static inline int chan_drain(struct dsa_chan *c)
+{
+	return c->backend->drain(c);
+}
+
+/*
+ * Submission counters of one caller, which passes them to dsa_submit(). A
+ * rejection is a dsa_submit() that still got -EAGAIN after all retries;
+ * retry_ns covers the time from the first rejected attempt to the last one.
+ */
+struct submit_stats {
+	u64 submitted;
+	u64 retries;
+	u64 rejected;
+	u64 retry_ns;
+};
+
+// Protection information appended to every block by the DIF operations
+#define DIF_BLOCK_SIZE	(512)
+
+struct dif_tuple {
+	__be16 guard;	// CRC16 T10-DIF of the block
+	__be16 app_tag;
+	__be32 ref_tag;
+} __packed;
+
+// Delta record entry of CR_DELTA/AP_DELTA; offsets count 8-byte words
+#define DELTA_MAX_XFER	(0x80000)
+
+struct delta_entry {
+	u16 offset;
+	u64 data;
+} __packed;
+
+void dsa_prep(struct dsa_hw_desc *desc, u8 opcode, u64 addr_f1, u64 addr_f2, u64 len, u64 compl, u32 flags);
+/*
+ * comp is the record dsa_comp_wait() will wait on, or NULL if nobody sleeps
+ * on it; in interrupt mode only such descriptors request an interrupt.
+ * stats, if not NULL, accumulates the outcome.
+ */
+int dsa_submit(struct dsa_chan *c, struct dsa_hw_desc *desc, struct dsa_completion_record *comp,
+		struct submit_stats *stats);
+u32 dsa_comp_flags(void);
+u64 dsa_comp_timeout_ns(void);
+void dsa_comp_wait(struct dsa_chan *c, struct dsa_completion_record *comp);
+
+// Returns the completion status, or -ETIMEDOUT after dsa_comp_timeout_ns()
+int dsa_poll(struct dsa_chan *c, struct dsa_completion_record *comp);
+
+// Non-blocking dsa_poll(): returns 0 while the descriptor is still in flight
+static inline int peek(struct dsa_completion_record *comp)
+{
+	return DSA_COMP_STATUS(READ_ONCE(comp->status));
+}
+
+/*
+ * Whether a drain aborted the descriptor instead of running it. The status
+ * is the driver's software code, which DSA_COMP_STATUS() would mask.
+ */
+static inline bool comp_aborted(struct dsa_completion_record *comp)
+{
+	return READ_ONCE(comp->status) == IDXD_COMP_DESC_ABORT;
+}
+
+void dsa_print_comp(const struct dsa_completion_record *comp);
 
 #endif
@@ -0,0 +1,667 @@
+#include "emu.h"
+
+#include <linux/crc-t10dif.h>
+#include <linux/crc32c.h>
+#include <linux/delay.h>
+#include <linux/export.h>
+#include <linux/ktime.h>
+#include <linux/kthread.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/wait_bit.h>
+
+#include "pmu.h"
+
+/*
+ * Software DSA. Every emulated WQ owns a ring of EMU_WQ_SIZE descriptor slots
+ * and one worker thread that plays the role of an engine: it pops descriptors
+ * in submission order, executes them on the CPU and writes the completion
+ * record the same way the device does (status byte last). DMA addresses are
+ * kernel virtual addresses, so buffers are "mapped" by casting their pointers.
+ */
+
+struct emu_wq {
+	struct dsa_chan chan;
+
+	spinlock_t lock;
+	struct dsa_hw_desc ring[EMU_WQ_SIZE];
+	unsigned int head, tail;
+	unsigned int done;	// executed
+
+	wait_queue_head_t waitq;
+	struct task_struct *worker;
+
+	u64 *pmu;	// perfmon registers of the device
+};
+
+/*
+ * Emulated devices have no MMIO, so each gets a page laid out like the idxd
+ * perfmon table. pmu.c programs it as it would the device, and the workers
+ * add to the enabled counters. Engine busy counts nanoseconds and WQ
+ * occupancy sums the queue depth seen by every descriptor.
+ */
+static struct {
+	u64 *regs;
+	int users;
+} emu_pmu[EMU_MAX_DEV];
+static DEFINE_MUTEX(emu_pmu_lock);
+
+static inline void *emu_addr(u64 addr)
+{
+	return (void *)(uintptr_t)addr;
+}
+
+static u8 emu_fill(struct dsa_hw_desc *desc)
+{
+	u8 *dst = emu_addr(desc->dst_addr);
+	u64 pattern = desc->pattern;
+	u32 i;
+
+	for (i = 0; i < desc->xfer_size; i++)
+		dst[i] = ((u8 *)&pattern)[i % sizeof(pattern)];
+
+	return DSA_COMP_SUCCESS;
+}
+
+static u8 emu_compare(struct dsa_hw_desc *desc, struct dsa_completion_record *comp)
+{
+	const u8 *src1 = emu_addr(desc->src_addr);
+	const u8 *src2 = emu_addr(desc->src2_addr);
+	u32 i;
+
+	for (i = 0; i < desc->xfer_size; i++)
+		if (src1[i] != src2[i])
+			break;
+
+	comp->result = i != desc->xfer_size;
+	comp->bytes_completed = i;
+	return DSA_COMP_SUCCESS;
+}
+
+static u8 emu_compval(struct dsa_hw_desc *desc, struct dsa_completion_record *comp)
+{
+	const u8 *src = emu_addr(desc->src_addr);
+	u64 pattern = desc->comp_pattern;
+	u32 i;
+
+	for (i = 0; i < desc->xfer_size; i++)
+		if (src[i] != ((u8 *)&pattern)[i % sizeof(pattern)])
+			break;
+
+	comp->result = i != desc->xfer_size;
+	comp->bytes_completed = i;
+	return DSA_COMP_SUCCESS;
+}
+
+static u8 emu_cr_delta(struct dsa_hw_desc *desc, struct dsa_completion_record *comp)
+{
+	const u64 *src1 = emu_addr(desc->src_addr);
+	const u64 *src2 = emu_addr(desc->src2_addr);
+	struct delta_entry *delta = emu_addr(desc->delta_addr);
+	u32 i, n = 0;
+
+	if (desc->xfer_size % sizeof(u64) || desc->xfer_size > DELTA_MAX_XFER)
+		return DSA_COMP_XFER_ERANGE;
+	if (desc->max_delta_size % sizeof(*delta))
+		return DSA_COMP_DR_ERANGE;
+
+	for (i = 0; i < desc->xfer_size / sizeof(u64); i++) {
+		if (src1[i] == src2[i])
+			continue;
+
+		// The record is full; report the overflow with the offset reached
+		if ((n + 1) * sizeof(*delta) > desc->max_delta_size) {
+			comp->result = 2;
+			comp->bytes_completed = i * sizeof(u64);
+			return DSA_COMP_SUCCESS;
+		}
+
+		delta[n].offset = i;
+		delta[n].data = src2[i];
+		n++;
+	}
+
+	comp->result = n != 0;
+	comp->delta_rec_size = n * sizeof(*delta);
+	return DSA_COMP_SUCCESS;
+}
+
+static u8 emu_ap_delta(struct dsa_hw_desc *desc)
+{
+	const struct delta_entry *delta = emu_addr(desc->src_addr);
+	u64 *dst = emu_addr(desc->dst_addr);
+	u32 i, n;
+
+	if (desc->delta_rec_size % sizeof(*delta))
+		return DSA_COMP_DR_ERANGE;
+
+	n = desc->delta_rec_size / sizeof(*delta);
+	for (i = 0; i < n; i++) {
+		if (delta[i].offset >= desc->xfer_size / sizeof(u64))
+			return DSA_COMP_DR_OFFSET_ERANGE;
+		if (i && delta[i].offset <= delta[i - 1].offset)
+			return DSA_COMP_DR_OFFSET_NOINC;
+		dst[delta[i].offset] = delta[i].data;
+	}
+
+	return DSA_COMP_SUCCESS;
+}
+
+static u8 emu_dualcast(struct dsa_hw_desc *desc)
+{
+	// Both destinations must sit at the same offset within a page
+	if ((desc->dst_addr ^ desc->dest2) & (PAGE_SIZE - 1))
+		return DSA_COMP_DCAST_ERR;
+
+	memcpy(emu_addr(desc->dst_addr), emu_addr(desc->src_addr), desc->xfer_size);
+	memcpy(emu_addr(desc->dest2), emu_addr(desc->src_addr), desc->xfer_size);
+	return DSA_COMP_SUCCESS;
+}
+
+/*
+ * DIF flags select the block size in their low two bits. Reference tags
+ * increment per block from the seed, and application tag bits set in the mask
+ * are not checked.
+ */
+static const u32 emu_dif_block[] = { 512, 520, 4096, 4104 };
+
+#define EMU_DIF_GUARD	(1 << 0)
+#define EMU_DIF_APP	(1 << 1)
+#define EMU_DIF_REF	(1 << 2)
+
+// Checks the protection information of src, and with dst also strips it
+static u8 emu_dif_check(struct dsa_hw_desc *desc, struct dsa_completion_record *comp, u8 *dst)
+{
+	u32 bs = emu_dif_block[desc->src_dif_flags & 3];
+	const u8 *src = emu_addr(desc->src_addr);
+	const struct dif_tuple *dif;
+	u32 i, nr_blk;
+	u8 err;
+
+	if (desc->xfer_size % (bs + sizeof(*dif)))
+		return DSA_COMP_XFER_ERANGE;
+
+	nr_blk = desc->xfer_size / (bs + sizeof(*dif));
+	for (i = 0; i < nr_blk; i++, src += bs + sizeof(*dif)) {
+		dif = (const struct dif_tuple *)(src + bs);
+
+		err = 0;
+		if (be16_to_cpu(dif->guard) != crc_t10dif(src, bs))
+			err |= EMU_DIF_GUARD;
+		if ((be16_to_cpu(dif->app_tag) ^ desc->chk_app_tag_seed) & ~desc->chk_app_tag_mask)
+			err |= EMU_DIF_APP;
+		if (be32_to_cpu(dif->ref_tag) != desc->chk_ref_tag_seed + i)
+			err |= EMU_DIF_REF;
+		if (err) {
+			comp->dif_status = err;
+			comp->bytes_completed = i * (bs + sizeof(*dif));
+			return DSA_COMP_DIF_ERR;
+		}
+
+		if (dst) {
+			memcpy(dst, src, bs);
+			dst += bs;
+		}
+	}
+
+	comp->dif_chk_ref_tag = desc->chk_ref_tag_seed + nr_blk;
+	comp->dif_chk_app_tag_mask = desc->chk_app_tag_mask;
+	comp->dif_chk_app_tag = desc->chk_app_tag_seed;
+	return DSA_COMP_SUCCESS;
+}
+
+static u8 emu_dif_ins(struct dsa_hw_desc *desc, struct dsa_completion_record *comp)
+{
+	u32 bs = emu_dif_block[desc->dest_dif_flag & 3];
+	const u8 *src = emu_addr(desc->src_addr);
+	u8 *dst = emu_addr(desc->dst_addr);
+	struct dif_tuple *dif;
+	u32 i, nr_blk;
+
+	if (desc->xfer_size % bs)
+		return DSA_COMP_XFER_ERANGE;
+
+	nr_blk = desc->xfer_size / bs;
+	for (i = 0; i < nr_blk; i++, src += bs, dst += bs + sizeof(*dif)) {
+		memcpy(dst, src, bs);
+		dif = (struct dif_tuple *)(dst + bs);
+		dif->guard = cpu_to_be16(crc_t10dif(src, bs));
+		dif->app_tag = cpu_to_be16(desc->ins_app_tag_seed);
+		dif->ref_tag = cpu_to_be32(desc->ins_ref_tag_seed + i);
+	}
+
+	comp->dif_ins_ref_tag = desc->ins_ref_tag_seed + nr_blk;
+	comp->dif_ins_app_tag_mask = desc->ins_app_tag_mask;
+	comp->dif_ins_app_tag = desc->ins_app_tag_seed;
+	return DSA_COMP_SUCCESS;
+}
+
+static u32 emu_crc(struct dsa_hw_desc *desc)
+{
+	// The device inverts both the seed and the result by default
+	return ~crc32c(~desc->crc_seed, emu_addr(desc->src_addr), desc->xfer_size);
+}
+
+static u8 emu_exec(struct dsa_hw_desc *desc);
+
+static u8 emu_batch(struct dsa_hw_desc *desc, struct dsa_completion_record *comp)
+{
+	struct dsa_hw_desc *list = emu_addr(desc->desc_list_addr);
+	u32 i, failed = 0;
+	u8 status;
+
+	if (desc->desc_count < 2 || desc->desc_count > EMU_MAX_BATCH)
+		return DSA_COMP_DESC_CNT_ERANGE;
+	if (!IS_ALIGNED(desc->desc_list_addr, 64))
+		return DSA_COMP_DESCLIST_ALIGN;
+
+	for (i = 0; i < desc->desc_count; i++) {
+		if (list[i].opcode == DSA_OPCODE_BATCH)
+			status = DSA_COMP_BAD_OPCODE;
+		else
+			status = emu_exec(&list[i]);
+		if (status != DSA_COMP_SUCCESS)
+			failed++;
+	}
+
+	comp->bytes_completed = desc->desc_count;
+	return failed ? DSA_COMP_BATCH_FAIL : DSA_COMP_SUCCESS;
+}
+
+// Writes the completion record of desc if requested and returns status
+static u8 emu_complete(struct dsa_hw_desc *desc, struct dsa_completion_record *rec, u8 status)
+{
+	struct dsa_completion_record *comp = emu_addr(desc->completion_addr);
+
+	// A record is written on request, or on error when its address is valid
+	if (!(desc->flags & IDXD_OP_FLAG_RCR) &&
+	    !(status != DSA_COMP_SUCCESS && (desc->flags & IDXD_OP_FLAG_CRAV)))
+		return status;
+	if (!comp || !IS_ALIGNED(desc->completion_addr, 32))
+		return status;
+
+	// The status byte goes last so that dsa_poll() never sees a partial record
+	memcpy((u8 *)comp + 1, (u8 *)rec + 1, sizeof(*rec) - 1);
+	smp_wmb();
+	WRITE_ONCE(comp->status, status);
+
+	// Completion interrupt
+	if (desc->flags & IDXD_OP_FLAG_RCI) {
+		smp_mb();
+		wake_up_var(comp);
+	}
+
+	return status;
+}
+
+// Executes one descriptor and returns its completion status
+static u8 emu_exec(struct dsa_hw_desc *desc)
+{
+	struct dsa_completion_record rec;
+	u8 status;
+
+	memset(&rec, 0, sizeof(rec));
+
+	if (desc->opcode != DSA_OPCODE_BATCH && desc->xfer_size > EMU_MAX_XFER) {
+		status = DSA_COMP_XFER_ERANGE;
+		goto out;
+	}
+
+	switch (desc->opcode) {
+	case DSA_OPCODE_NOOP:
+	case DSA_OPCODE_DRAIN:
+	case DSA_OPCODE_CFLUSH:
+		status = DSA_COMP_SUCCESS;
+		break;
+	case DSA_OPCODE_BATCH:
+		status = emu_batch(desc, &rec);
+		break;
+	case DSA_OPCODE_MEMMOVE:
+		memmove(emu_addr(desc->dst_addr), emu_addr(desc->src_addr), desc->xfer_size);
+		status = DSA_COMP_SUCCESS;
+		break;
+	case DSA_OPCODE_MEMFILL:
+		status = emu_fill(desc);
+		break;
+	case DSA_OPCODE_COMPARE:
+		status = emu_compare(desc, &rec);
+		break;
+	case DSA_OPCODE_COMPVAL:
+		status = emu_compval(desc, &rec);
+		break;
+	case DSA_OPCODE_CR_DELTA:
+		status = emu_cr_delta(desc, &rec);
+		break;
+	case DSA_OPCODE_AP_DELTA:
+		status = emu_ap_delta(desc);
+		break;
+	case DSA_OPCODE_DUALCAST:
+		status = emu_dualcast(desc);
+		break;
+	case DSA_OPCODE_CRCGEN:
+		rec.crc_val = emu_crc(desc);
+		status = DSA_COMP_SUCCESS;
+		break;
+	case DSA_OPCODE_COPY_CRC:
+		memcpy(emu_addr(desc->dst_addr), emu_addr(desc->src_addr), desc->xfer_size);
+		rec.crc_val = emu_crc(desc);
+		status = DSA_COMP_SUCCESS;
+		break;
+	case DSA_OPCODE_DIF_CHECK:
+		status = emu_dif_check(desc, &rec, NULL);
+		break;
+	case DSA_OPCODE_DIF_INS:
+		status = emu_dif_ins(desc, &rec);
+		break;
+	case DSA_OPCODE_DIF_STRP:
+		status = emu_dif_check(desc, &rec, emu_addr(desc->dst_addr));
+		break;
+	default:
+		status = DSA_COMP_BAD_OPCODE;
+		break;
+	}
+
+out:
+	return emu_complete(desc, &rec, status);
+}
+
+// Bytes desc reads and writes, roughly as the device would move them
+static void emu_bytes(struct dsa_hw_desc *desc, u64 *rd, u64 *wr)
+{
+	struct dsa_hw_desc *list;
+	u64 len = desc->xfer_size;
+	u32 i;
+
+	switch (desc->opcode) {
+	case DSA_OPCODE_BATCH:
+		list = emu_addr(desc->desc_list_addr);
+		*rd += desc->desc_count * sizeof(*list);
+		for (i = 0; i < desc->desc_count && i < EMU_MAX_BATCH; i++)
+			if (list[i].opcode != DSA_OPCODE_BATCH)
+				emu_bytes(&list[i], rd, wr);
+		break;
+	case DSA_OPCODE_MEMMOVE:
+	case DSA_OPCODE_COPY_CRC:
+	case DSA_OPCODE_DIF_INS:
+	case DSA_OPCODE_DIF_STRP:
+		*rd += len;
+		*wr += len;
+		break;
+	case DSA_OPCODE_MEMFILL:
+		*wr += len;
+		break;
+	case DSA_OPCODE_COMPARE:
+	case DSA_OPCODE_CR_DELTA:
+		*rd += 2 * len;
+		break;
+	case DSA_OPCODE_COMPVAL:
+	case DSA_OPCODE_CRCGEN:
+	case DSA_OPCODE_DIF_CHECK:
+		*rd += len;
+		break;
+	case DSA_OPCODE_AP_DELTA:
+		*rd += desc->delta_rec_size;
+		*wr += desc->delta_rec_size / sizeof(struct delta_entry) * sizeof(u64);
+		break;
+	case DSA_OPCODE_DUALCAST:
+		*rd += len;
+		*wr += 2 * len;
+		break;
+	}
+}
+
+static void emu_pmu_count(struct emu_wq *wq, struct dsa_hw_desc *desc, u32 occ, u64 ns)
+{
+	union idxd_cntrcfg cfg;
+	u64 rd = 0, wr = 0;
+	u64 val[PMU_NR_EVENT];
+	int ev, i;
+
+	if (!wq->pmu)
+		return;
+
+	emu_bytes(desc, &rd, &wr);
+	val[PMU_DESC] = desc->opcode == DSA_OPCODE_BATCH ? desc->desc_count : 1;
+	val[PMU_RD_BYTES] = rd;
+	val[PMU_WR_BYTES] = wr;
+	val[PMU_ATS_MISS] = 0;
+	val[PMU_ENG_BUSY] = ns;
+	val[PMU_WQ_OCC] = occ;
+
+	for (i = 0; i < EMU_PMU_CNTR; i++) {
+		cfg.val = READ_ONCE(wq->pmu[PMU_CNTRCFG(i) / sizeof(u64)]);
+		if (!cfg.enable)
+			continue;
+
+		ev = pmu_event_of(cfg.event_category, cfg.events);
+		if (ev >= 0)
+			atomic64_add(val[ev], (atomic64_t *)&wq->pmu[PMU_CNTRDATA(i) / sizeof(u64)]);
+	}
+}
+
+static int emu_worker(void *data)
+{
+	struct emu_wq *wq = data;
+	struct dsa_hw_desc desc;
+	u32 occ;
+	u64 ns;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(wq->waitq, READ_ONCE(wq->head) != READ_ONCE(wq->tail) || kthread_should_stop());
+
+		spin_lock(&wq->lock);
+		if (wq->head == wq->tail) {
+			spin_unlock(&wq->lock);
+			continue;
+		}
+		occ = wq->tail - wq->head;
+		desc = wq->ring[wq->head % EMU_WQ_SIZE];
+		wq->head++;
+		spin_unlock(&wq->lock);
+
+		ns = ktime_get_ns();
+		emu_exec(&desc);
+		emu_pmu_count(wq, &desc, occ, ktime_get_ns() - ns);
+
+		spin_lock(&wq->lock);
+		wq->done++;
+		spin_unlock(&wq->lock);
+
+		cond_resched();
+	}
+
+	return 0;
+}
+
+static int emu_submit(struct dsa_chan *c, struct dsa_hw_desc *desc, struct dsa_completion_record *comp)
+{
+	struct emu_wq *wq = c->emu;
+
+	spin_lock(&wq->lock);
+	if (wq->tail - wq->head == EMU_WQ_SIZE) {
+		// A full shared WQ rejects ENQCMDS with retry status
+		spin_unlock(&wq->lock);
+		return -EAGAIN;
+	}
+	wq->ring[wq->tail % EMU_WQ_SIZE] = *desc;
+	wq->tail++;
+	spin_unlock(&wq->lock);
+
+	if (wq_has_sleeper(&wq->waitq))
+		wake_up(&wq->waitq);
+
+	return 0;
+}
+
+static dma_addr_t emu_map(struct dsa_chan *c, void *addr, size_t len)
+{
+	return (dma_addr_t)(uintptr_t)addr;
+}
+
+static void emu_unmap(struct dsa_chan *c, dma_addr_t addr, size_t len)
+{
+}
+
+static dma_addr_t emu_map_resource(struct dsa_chan *c, phys_addr_t phys, size_t len)
+{
+	// The emulator cannot reach device memory
+	return DMA_MAPPING_ERROR;
+}
+
+static void emu_unmap_resource(struct dsa_chan *c, dma_addr_t addr, size_t len)
+{
+}
+
+static int emu_map_sg(struct dsa_chan *c, struct sg_table *sgt)
+{
+	struct scatterlist *sg;
+	int i;
+
+	for_each_sgtable_sg(sgt, sg, i) {
+		sg_dma_address(sg) = (dma_addr_t)(uintptr_t)sg_virt(sg);
+		sg_dma_len(sg) = sg->length;
+	}
+	sgt->nents = sgt->orig_nents;
+
+	return 0;
+}
+
+static void emu_unmap_sg(struct dsa_chan *c, struct sg_table *sgt)
+{
+}
+
+static int emu_drain(struct dsa_chan *c)
+{
+	struct emu_wq *wq = c->emu;
+	unsigned int target;
+	u64 deadline;
+
+	/*
+	 * Like a Drain descriptor, waits for everything queued before it to run.
+	 * The WQ may be shared, so aborting would fail other submitters too.
+	 */
+	spin_lock(&wq->lock);
+	target = wq->tail;
+	spin_unlock(&wq->lock);
+
+	deadline = ktime_get_ns() + dsa_comp_timeout_ns();
+	while ((int)(READ_ONCE(wq->done) - target) < 0) {
+		if (ktime_get_ns() > deadline)
+			return -ETIMEDOUT;
+		usleep_range(10, 20);
+	}
+
+	return 0;
+}
+
+// The perfmon page of dev_id, shared by the channels of the device
+static u64 *emu_pmu_get(int dev_id)
+{
+	u64 *regs;
+
+	if (dev_id < 0 || dev_id >= EMU_MAX_DEV)
+		return NULL;
+
+	mutex_lock(&emu_pmu_lock);
+	if (!emu_pmu[dev_id].regs) {
+		emu_pmu[dev_id].regs = alloc_pages_exact(PAGE_SIZE, GFP_KERNEL | __GFP_ZERO);
+		if (emu_pmu[dev_id].regs)
+			pmu_emu_caps((void __iomem *)emu_pmu[dev_id].regs, EMU_PMU_CNTR);
+	}
+	if (emu_pmu[dev_id].regs)
+		emu_pmu[dev_id].users++;
+	regs = emu_pmu[dev_id].regs;
+	mutex_unlock(&emu_pmu_lock);
+
+	return regs;
+}
+
+static void emu_pmu_put(int dev_id, u64 *regs)
+{
+	if (!regs)
+		return;
+
+	mutex_lock(&emu_pmu_lock);
+	if (!--emu_pmu[dev_id].users) {
+		free_pages_exact(regs, PAGE_SIZE);
+		emu_pmu[dev_id].regs = NULL;
+	}
+	mutex_unlock(&emu_pmu_lock);
+}
+
+void __iomem *emu_pmu_regs(struct dsa_chan *c)
+{
+	return (void __iomem *)c->emu->pmu;
+}
+
+static void emu_release(struct dsa_chan *c)
+{
+	struct emu_wq *wq = c->emu;
+
+	kthread_stop(wq->worker);
+	emu_pmu_put(c->dev_id, wq->pmu);
+	kfree(wq);
+}
+
+static const struct dsa_backend emu_backend = {
+	.name = "emu",
+	.submit = emu_submit,
+	.map = emu_map,
+	.unmap = emu_unmap,
+	.map_resource = emu_map_resource,
+	.unmap_resource = emu_unmap_resource,
+	.map_sg = emu_map_sg,
+	.unmap_sg = emu_unmap_sg,
+	.drain = emu_drain,
+	.release = emu_release,
+};
+
+// Opcodes emu_exec() runs
+static const u8 emu_ops[] = {
+	DSA_OPCODE_NOOP, DSA_OPCODE_BATCH, DSA_OPCODE_DRAIN, DSA_OPCODE_MEMMOVE,
+	DSA_OPCODE_MEMFILL, DSA_OPCODE_COMPARE, DSA_OPCODE_COMPVAL, DSA_OPCODE_CR_DELTA,
+	DSA_OPCODE_AP_DELTA, DSA_OPCODE_DUALCAST, DSA_OPCODE_CRCGEN, DSA_OPCODE_COPY_CRC,
+	DSA_OPCODE_DIF_CHECK, DSA_OPCODE_DIF_INS, DSA_OPCODE_DIF_STRP, DSA_OPCODE_CFLUSH,
+};
+
+// The emulated device sits on node, whose CPUs run its worker
+struct dsa_chan *dsa_emu_chan_create(const char *name, int dev_id, int node)
+{
+	struct emu_wq *wq;
+	int i;
+
+	wq = kzalloc_node(sizeof(*wq), GFP_KERNEL, node);
+	if (!wq)
+		return NULL;
+
+	spin_lock_init(&wq->lock);
+	init_waitqueue_head(&wq->waitq);
+
+	wq->chan.backend = &emu_backend;
+	wq->chan.emu = wq;
+	wq->chan.dev_id = dev_id;
+	wq->chan.node = node;
+	wq->chan.max_xfer = EMU_MAX_XFER;
+	wq->chan.max_batch = EMU_MAX_BATCH;
+	wq->chan.wq_size = EMU_WQ_SIZE;
+	wq->chan.cc_cache = true;
+	for (i = 0; i < ARRAY_SIZE(emu_ops); i++)
+		wq->chan.opcap[emu_ops[i] / 64] |= BIT_ULL(emu_ops[i] % 64);
+	strscpy(wq->chan.name, name, sizeof(wq->chan.name));
+
+	wq->worker = kthread_create_on_node(emu_worker, wq, node, "kdsa_emu_%s", name);
+	if (IS_ERR(wq->worker)) {
+		printk("kdsa: failed to create emulation worker for %s\n", name);
+		kfree(wq);
+		return NULL;
+	}
+	if (node != NUMA_NO_NODE)
+		set_cpus_allowed_ptr(wq->worker, cpumask_of_node(node));
+	wq->pmu = emu_pmu_get(dev_id);
+	wake_up_process(wq->worker);
+
+	return &wq->chan;
+}
+EXPORT_SYMBOL_GPL(dsa_emu_chan_create);
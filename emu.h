@@ -0,0 +1,18 @@
+#ifndef _EMU_H_
+#define _EMU_H_
+
+#include "driver.h"
+
+#define EMU_WQ_SIZE	(16)	// --wq-size in scripts/setup_dsa.sh
+#define EMU_MAX_BATCH	(1024)	// --max-batch-size in scripts/setup_dsa.sh
+#define EMU_MAX_XFER	(WQ_DEFAULT_MAX_XFER)
+
+#define EMU_NR_CHAN	(8)	// channels per emulated device unless nr_chan says otherwise
+
+#define EMU_MAX_DEV	(64)	// emulated devices with perfmon registers
+#define EMU_PMU_CNTR	(8)
+
+struct dsa_chan *dsa_emu_chan_create(const char *name, int dev_id, int node);
+void __iomem *emu_pmu_regs(struct dsa_chan *c);
+
+#endif
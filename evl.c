@@ -0,0 +1,73 @@
+#include "evl.h"
+
+#include <linux/io.h>
+#include <linux/spinlock.h>
+
+static void evl_dump_swerr(struct seq_file *m, int dev_id, const char *which, const union sw_err_reg *reg)
+{
+	seq_printf(m, "swerr %d %s %#018llx %#018llx %#018llx %#018llx\n",
+			dev_id, which, reg->bits[0], reg->bits[1], reg->bits[2], reg->bits[3]);
+}
+
+static bool evl_empty(const u64 *words, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		if (words[i])
+			return false;
+	return true;
+}
+
+void evl_dump(struct seq_file *m, struct dsa_chan *c)
+{
+	struct idxd_device *idxd;
+	struct idxd_evl *evl;
+	union evl_status_reg status;
+	union sw_err_reg swerr;
+	unsigned int ent_size, slot, i;
+	const u64 *words;
+	int w;
+
+	// The emulator reports every error in the completion record
+	if (c->emu) {
+		seq_printf(m, "dev %d %s emulated\n", c->dev_id, c->name);
+		return;
+	}
+
+	idxd = to_idxd_wq(c->chan)->idxd;
+	evl = idxd->evl;
+	ent_size = evl_ent_size(idxd);
+
+	status.bits = 0;
+	if (evl)
+		status.bits = readq(idxd->reg_base + IDXD_EVLSTATUS_OFFSET);
+	seq_printf(m, "dev %d %s evl_size %u entry_size %u head %u tail %u\n",
+			c->dev_id, dev_name(&idxd->pdev->dev), evl ? evl->size : 0, ent_size,
+			status.head, status.tail);
+
+	for (w = 0; w < ARRAY_SIZE(swerr.bits); w++)
+		swerr.bits[w] = readq(idxd->reg_base + IDXD_SWERR_OFFSET + w * sizeof(u64));
+	evl_dump_swerr(m, c->dev_id, "live", &swerr);
+	evl_dump_swerr(m, c->dev_id, "last", &idxd->sw_err);
+
+	if (!evl || !ent_size)
+		return;
+
+	// The driver consumes entries from head under the same lock
+	spin_lock(&evl->lock);
+	for (i = 0; i < evl->size; i++) {
+		slot = (status.tail + i) % evl->size;
+		words = evl->log + slot * ent_size;
+		if (evl_empty(words, ent_size / sizeof(u64)))
+			continue;
+
+		seq_printf(m, "evl %d %u %d", c->dev_id, slot,
+				(slot - status.head + evl->size) % evl->size <
+				(status.tail - status.head + evl->size) % evl->size);
+		for (w = 0; w < ent_size / sizeof(u64); w++)
+			seq_printf(m, " %#018llx", words[w]);
+		seq_putc(m, '\n');
+	}
+	spin_unlock(&evl->lock);
+}
@@ -0,0 +1,22 @@
+#ifndef _EVL_H_
+#define _EVL_H_
+
+#include <linux/seq_file.h>
+
+#include "driver.h"
+
+/*
+ * Dump of the error registers of a device, one record per line with the raw
+ * register words in hex, for tools/sw_err.c to decode:
+ *
+ *   dev <dev_id> <name> evl_size <entries> entry_size <bytes> head <h> tail <t>
+ *   swerr <dev_id> live|last <w0> <w1> <w2> <w3>
+ *   evl <dev_id> <slot> <pending> <w0> ... <wN>
+ *
+ * "live" reads the SWERR register now, "last" is the copy the idxd driver
+ * saved before acknowledging it. Event log entries are listed oldest first;
+ * pending ones have not been processed by the driver yet.
+ */
+void evl_dump(struct seq_file *m, struct dsa_chan *c);
+
+#endif
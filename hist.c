@@ -0,0 +1,55 @@
+#include "hist.h"
+
+#include <linux/math64.h>
+#include <linux/minmax.h>
+#include <linux/string.h>
+
+// Largest value that falls into bucket idx
+static u64 hist_bucket_max(unsigned int idx)
+{
+	unsigned int e, m;
+
+	if (idx < (1 << HIST_SUB_BITS))
+		return idx;
+
+	e = idx >> HIST_SUB_BITS;
+	m = idx & ((1 << HIST_SUB_BITS) - 1);
+	return (((u64)(1 << HIST_SUB_BITS) + m) << (e - 1)) + (1ULL << (e - 1)) - 1;
+}
+
+void hist_reset(struct hist *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+void hist_merge(struct hist *dst, const struct hist *src)
+{
+	unsigned int i;
+
+	for (i = 0; i < HIST_NR_BUCKET; i++)
+		dst->count[i] += src->count[i];
+	dst->total += src->total;
+	dst->max = max(dst->max, src->max);
+}
+
+/*
+ * Returns an upper bound of the per100k/100000 quantile, e.g. 99900 for
+ * p99.9, or 0 for an empty histogram.
+ */
+u64 hist_percentile(const struct hist *h, unsigned int per100k)
+{
+	u64 rank, seen = 0;
+	unsigned int i;
+
+	if (!h->total)
+		return 0;
+
+	rank = div_u64(h->total * per100k + 99999, 100000);
+	for (i = 0; i < HIST_NR_BUCKET; i++) {
+		seen += h->count[i];
+		if (seen >= rank)
+			return min(hist_bucket_max(i), h->max);
+	}
+
+	return h->max;
+}
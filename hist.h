@@ -0,0 +1,45 @@
+#ifndef _HIST_H_
+#define _HIST_H_
+
+#include <linux/bitops.h>
+#include <linux/types.h>
+
+/*
+ * Log-linear histogram: values below 2^HIST_SUB_BITS get a bucket each, and
+ * every power of two above is split into 2^HIST_SUB_BITS linear buckets, so
+ * the relative error stays under 1/2^HIST_SUB_BITS across the whole range.
+ * A histogram has a single writer; readers merge after the writers stop.
+ */
+#define HIST_SUB_BITS	(4)
+#define HIST_NR_BUCKET	((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct hist {
+	u64 count[HIST_NR_BUCKET];
+	u64 total;
+	u64 max;
+};
+
+static inline unsigned int hist_bucket(u64 v)
+{
+	unsigned int e;
+
+	if (v < (1 << HIST_SUB_BITS))
+		return v;
+
+	e = fls64(v) - HIST_SUB_BITS;
+	return (e << HIST_SUB_BITS) + (v >> (e - 1)) - (1 << HIST_SUB_BITS);
+}
+
+static inline void hist_record(struct hist *h, u64 v)
+{
+	h->count[hist_bucket(v)]++;
+	h->total++;
+	if (v > h->max)
+		h->max = v;
+}
+
+void hist_reset(struct hist *h);
+void hist_merge(struct hist *dst, const struct hist *src);
+u64 hist_percentile(const struct hist *h, unsigned int per100k);
+
+#endif
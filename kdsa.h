@@ -0,0 +1,39 @@
+#ifndef _KDSA_H_
+#define _KDSA_H_
+
+#include <linux/err.h>
+#include <linux/types.h>
+
+struct dsa_chan;
+
+/*
+ * Offload API of the kdsa module. Every call submits one descriptor through
+ * the calling CPU's context, which owns a channel on the CPU's node and a
+ * pool of completion records; the request is returned at once, or an
+ * ERR_PTR: -ENODEV without channels, -EINVAL for buffers the channel cannot
+ * take, -ENOMEM when they cannot be mapped, -EAGAIN when the pool or the WQ
+ * is full. Buffers must be physically contiguous kernel memory, not vmalloc
+ * or stack, and stay valid until kdsa_wait() returns. The calls take no
+ * locks and are meant for process context; a request may be waited on from
+ * any CPU.
+ */
+struct kdsa_req;
+
+struct kdsa_req *kdsa_memcpy_async(void *dst, const void *src, size_t len);
+struct kdsa_req *kdsa_fill_async(void *dst, u64 pattern, size_t len);
+struct kdsa_req *kdsa_crc_async(const void *src, size_t len, u32 seed);
+
+// Returns true once the request has completed; kdsa_wait() will not block
+bool kdsa_poll(struct kdsa_req *req);
+
+/*
+ * Waits for the request and releases it. Returns 0, -EIO if the device
+ * failed it, or -ETIMEDOUT. result, if not NULL, receives the CRC of
+ * kdsa_crc_async().
+ */
+int kdsa_wait(struct kdsa_req *req, u64 *result);
+
+// Borrows the module's channels; max_dev and max_chan (per device) of 0 mean all
+int kdsa_get_chans(struct dsa_chan **chans, int max, int max_dev, int max_chan);
+
+#endif
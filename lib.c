@@ -0,0 +1,486 @@
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
+#include <linux/init.h>
+#include <linux/llist.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+
+#include "driver.h"
+#include "emu.h"
+#include "evl.h"
+#include "kdsa.h"
+#include "pmu.h"
+
+#define KDSA_MAX_CHAN	(256)
+#define KDSA_POOL_SIZE	(64)	// requests in flight per CPU
+
+static bool emulate;
+module_param(emulate, bool, 0444);
+MODULE_PARM_DESC(emulate, "Run on the software DSA emulator, one device per node, instead of hardware (default N)");
+
+static struct dsa_chan *kdsa_chan[KDSA_MAX_CHAN];
+static int nr_kdsa_chan;
+
+static struct dentry *debugfs_dir;
+
+struct kdsa_req {
+	struct kdsa_cpu *ctx;
+	int idx;
+	u8 opcode;
+	struct llist_node node;	// on ctx->remote once released by another CPU
+
+	struct dsa_hw_desc *desc;
+	struct dsa_completion_record *comp;
+	dma_addr_t comp_dma;
+	dma_addr_t src, dst;
+	size_t len;
+};
+
+/*
+ * Only the owning CPU touches the free stack, with preemption disabled, so
+ * taking a request needs no lock. Other CPUs hand requests back through the
+ * lock-free remote list, which the owner empties once its stack runs dry.
+ */
+struct kdsa_cpu {
+	struct dsa_chan *chan;
+	int cpu;
+
+	int free[KDSA_POOL_SIZE];
+	int nr_free;
+	struct llist_head remote;
+	atomic_t nr_leak;	// requests lost to a stuck WQ
+
+	struct kdsa_req req[KDSA_POOL_SIZE];
+
+	// Descriptors, then completion records; mapped once
+	void *arena;
+	dma_addr_t arena_dma;
+	size_t arena_size;
+};
+
+static DEFINE_PER_CPU(struct kdsa_cpu *, kdsa_cpu);
+
+int kdsa_get_chans(struct dsa_chan **chans, int max, int max_dev, int max_chan)
+{
+	int i, j, n, nr_dev, per_dev;
+
+	n = nr_dev = 0;
+	for (i = 0; i < nr_kdsa_chan && n < max; i++) {
+		per_dev = 0;
+		for (j = 0; j < n; j++)
+			if (chans[j]->dev_id == kdsa_chan[i]->dev_id)
+				per_dev++;
+
+		if (!per_dev && max_dev && nr_dev == max_dev)
+			continue;
+		if (max_chan && per_dev == max_chan)
+			continue;
+
+		if (!per_dev)
+			nr_dev++;
+		chans[n++] = kdsa_chan[i];
+	}
+
+	return n;
+}
+EXPORT_SYMBOL_GPL(kdsa_get_chans);
+
+// Request
+
+static struct kdsa_req *req_get(void)
+{
+	struct kdsa_req *req, *tmp;
+	struct kdsa_cpu *ctx;
+
+	preempt_disable();
+
+	ctx = this_cpu_read(kdsa_cpu);
+	if (!ctx) {
+		preempt_enable();
+		return ERR_PTR(-ENODEV);
+	}
+
+	if (!ctx->nr_free) {
+		llist_for_each_entry_safe(req, tmp, llist_del_all(&ctx->remote), node)
+			ctx->free[ctx->nr_free++] = req->idx;
+	}
+	req = ctx->nr_free ? &ctx->req[ctx->free[--ctx->nr_free]] : NULL;
+
+	preempt_enable();
+
+	return req ? req : ERR_PTR(-EAGAIN);
+}
+
+static void req_put(struct kdsa_req *req)
+{
+	struct kdsa_cpu *ctx = req->ctx;
+
+	if (get_cpu() == ctx->cpu)
+		ctx->free[ctx->nr_free++] = req->idx;
+	else
+		llist_add(&req->node, &ctx->remote);
+	put_cpu();
+}
+
+static void req_unmap(struct kdsa_req *req)
+{
+	if (req->src)
+		chan_unmap(req->ctx->chan, req->src, req->len);
+	if (req->dst)
+		chan_unmap(req->ctx->chan, req->dst, req->len);
+	req->src = req->dst = 0;
+}
+
+static struct kdsa_req *req_submit(struct kdsa_req *req)
+{
+	int rc;
+
+	rc = dsa_submit(req->ctx->chan, req->desc, req->comp, NULL);
+	if (rc) {
+		req_unmap(req);
+		req_put(req);
+		return ERR_PTR(rc);
+	}
+
+	return req;
+}
+
+// Only the linear map is physically contiguous; vmalloc and stack memory are not
+static bool req_dma_ok(const void *addr, size_t len)
+{
+	return virt_addr_valid(addr) && virt_addr_valid(addr + len - 1);
+}
+
+static dma_addr_t req_map_one(struct kdsa_req *req, const void *addr)
+{
+	dma_addr_t dma;
+
+	dma = chan_map(req->ctx->chan, (void *)addr, req->len);
+	return chan_map_error(req->ctx->chan, dma) ? 0 : dma;
+}
+
+/*
+ * Takes a request, checks len and the buffers (NULL if the operation has
+ * none) against its channel and maps them.
+ */
+static struct kdsa_req *req_prep(u8 opcode, void *dst, const void *src, size_t len)
+{
+	struct kdsa_req *req;
+	int rc = -EINVAL;
+
+	if (!len || (src && !req_dma_ok(src, len)) || (dst && !req_dma_ok(dst, len)))
+		return ERR_PTR(-EINVAL);
+
+	req = req_get();
+	if (IS_ERR(req))
+		return req;
+
+	if (len > req->ctx->chan->max_xfer)
+		goto err;
+
+	req->opcode = opcode;
+	req->len = len;
+
+	rc = -ENOMEM;
+	if (src && !(req->src = req_map_one(req, src)))
+		goto err;
+	if (dst && !(req->dst = req_map_one(req, dst)))
+		goto err;
+
+	return req;
+
+err:
+	req_unmap(req);
+	req_put(req);
+	return ERR_PTR(rc);
+}
+
+struct kdsa_req *kdsa_memcpy_async(void *dst, const void *src, size_t len)
+{
+	struct kdsa_req *req;
+
+	req = req_prep(DSA_OPCODE_MEMMOVE, dst, src, len);
+	if (IS_ERR(req))
+		return req;
+
+	dsa_prep(req->desc, DSA_OPCODE_MEMMOVE, req->src, req->dst, len, req->comp_dma, dsa_comp_flags());
+
+	return req_submit(req);
+}
+EXPORT_SYMBOL_GPL(kdsa_memcpy_async);
+
+struct kdsa_req *kdsa_fill_async(void *dst, u64 pattern, size_t len)
+{
+	struct kdsa_req *req;
+
+	req = req_prep(DSA_OPCODE_MEMFILL, dst, NULL, len);
+	if (IS_ERR(req))
+		return req;
+
+	dsa_prep(req->desc, DSA_OPCODE_MEMFILL, pattern, req->dst, len, req->comp_dma, dsa_comp_flags());
+
+	return req_submit(req);
+}
+EXPORT_SYMBOL_GPL(kdsa_fill_async);
+
+struct kdsa_req *kdsa_crc_async(const void *src, size_t len, u32 seed)
+{
+	struct kdsa_req *req;
+
+	req = req_prep(DSA_OPCODE_CRCGEN, NULL, src, len);
+	if (IS_ERR(req))
+		return req;
+
+	dsa_prep(req->desc, DSA_OPCODE_CRCGEN, req->src, 0, len, req->comp_dma, dsa_comp_flags());
+	req->desc->crc_seed = seed;
+
+	return req_submit(req);
+}
+EXPORT_SYMBOL_GPL(kdsa_crc_async);
+
+bool kdsa_poll(struct kdsa_req *req)
+{
+	return peek(req->comp);
+}
+EXPORT_SYMBOL_GPL(kdsa_poll);
+
+int kdsa_wait(struct kdsa_req *req, u64 *result)
+{
+	struct kdsa_cpu *ctx = req->ctx;
+	int rc;
+
+	rc = dsa_poll(ctx->chan, req->comp);
+	if (unlikely(rc < 0)) {
+		if (chan_drain(ctx->chan)) {
+			// The device may still write; the request is lost
+			printk_ratelimited("kdsa: request on %s stalled, leaking it\n", ctx->chan->name);
+			atomic_inc(&ctx->nr_leak);
+			return -ETIMEDOUT;
+		}
+		rc = peek(req->comp);
+	}
+
+	if (result && req->opcode == DSA_OPCODE_CRCGEN)
+		*result = req->comp->crc_val;
+
+	req->comp->status = 0;
+	req_unmap(req);
+	req_put(req);
+
+	if (rc == DSA_COMP_SUCCESS)
+		return 0;
+	return rc ? -EIO : -ETIMEDOUT;
+}
+EXPORT_SYMBOL_GPL(kdsa_wait);
+
+// Context
+
+// The rank-th of the channels on node, wrapping around; any channel if it has none
+static struct dsa_chan *lib_chan(int node, int rank)
+{
+	int i, cnt;
+
+	cnt = 0;
+	for (i = 0; i < nr_kdsa_chan; i++)
+		if (kdsa_chan[i]->node == node)
+			cnt++;
+	if (!cnt)
+		return kdsa_chan[rank % nr_kdsa_chan];
+
+	rank %= cnt;
+	for (i = 0; i < nr_kdsa_chan; i++)
+		if (kdsa_chan[i]->node == node && rank-- == 0)
+			break;
+
+	return kdsa_chan[i];
+}
+
+static struct kdsa_cpu *cpu_create(int cpu, struct dsa_chan *chan)
+{
+	struct dsa_completion_record *comp;
+	struct dsa_hw_desc *desc;
+	struct kdsa_cpu *ctx;
+	dma_addr_t comp_dma;
+	int node = cpu_to_node(cpu);
+	int i;
+
+	ctx = kzalloc_node(sizeof(*ctx), GFP_KERNEL, node);
+	if (!ctx)
+		return NULL;
+
+	ctx->chan = chan;
+	ctx->cpu = cpu;
+	init_llist_head(&ctx->remote);
+	atomic_set(&ctx->nr_leak, 0);
+
+	// Page aligned, so every descriptor is 64-byte and every record 32-byte aligned
+	ctx->arena_size = KDSA_POOL_SIZE * (sizeof(*desc) + sizeof(*comp));
+	ctx->arena = alloc_pages_exact_nid(node, ctx->arena_size, GFP_KERNEL | __GFP_ZERO);
+	if (!ctx->arena) {
+		kfree(ctx);
+		return NULL;
+	}
+	ctx->arena_dma = chan_map(chan, ctx->arena, ctx->arena_size);
+
+	desc = ctx->arena;
+	comp = (void *)&desc[KDSA_POOL_SIZE];
+	comp_dma = ctx->arena_dma + KDSA_POOL_SIZE * sizeof(*desc);
+
+	for (i = 0; i < KDSA_POOL_SIZE; i++) {
+		ctx->req[i].ctx = ctx;
+		ctx->req[i].idx = i;
+		ctx->req[i].desc = &desc[i];
+		ctx->req[i].comp = &comp[i];
+		ctx->req[i].comp_dma = comp_dma + i * sizeof(*comp);
+		ctx->free[ctx->nr_free++] = i;
+	}
+
+	return ctx;
+}
+
+static void cpu_destroy(struct kdsa_cpu *ctx)
+{
+	if (!ctx)
+		return;
+
+	// Leaked requests may still be written by the device
+	if (!atomic_read(&ctx->nr_leak)) {
+		chan_unmap(ctx->chan, ctx->arena_dma, ctx->arena_size);
+		free_pages_exact(ctx->arena, ctx->arena_size);
+	}
+	kfree(ctx);
+}
+
+static void lib_exit_cpus(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		cpu_destroy(per_cpu(kdsa_cpu, cpu));
+		per_cpu(kdsa_cpu, cpu) = NULL;
+	}
+}
+
+// Every CPU takes the next channel on its node, so the CPUs of a node spread over its WQs
+static int lib_init_cpus(void)
+{
+	int *rank;
+	int cpu, node;
+
+	rank = kcalloc(nr_node_ids, sizeof(int), GFP_KERNEL);
+	if (!rank)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		node = cpu_to_node(cpu);
+		per_cpu(kdsa_cpu, cpu) = cpu_create(cpu, lib_chan(node, node >= 0 ? rank[node]++ : cpu));
+		if (!per_cpu(kdsa_cpu, cpu)) {
+			kfree(rank);
+			lib_exit_cpus();
+			return -ENOMEM;
+		}
+	}
+
+	kfree(rank);
+	return 0;
+}
+
+// Module
+
+static int lib_emulate_chans(void)
+{
+	char chan_name[16];
+	int node, cid;
+	int n = 0;
+
+	for_each_online_node(node) {
+		for (cid = 0; cid < EMU_NR_CHAN && n < KDSA_MAX_CHAN; cid++) {
+			snprintf(chan_name, 16, "dma%dchan%d", node, cid);
+			kdsa_chan[n] = dsa_emu_chan_create(chan_name, node, node);
+			if (kdsa_chan[n])
+				n++;
+		}
+	}
+
+	return n;
+}
+
+static void lib_release_chans(void)
+{
+	int i;
+
+	for (i = 0; i < nr_kdsa_chan; i++)
+		dsa_chan_release(kdsa_chan[i]);
+	nr_kdsa_chan = 0;
+}
+
+// Error registers of every device, see evl.h
+static int errors_show(struct seq_file *m, void *unused)
+{
+	int i, j;
+
+	for (i = 0; i < nr_kdsa_chan; i++) {
+		for (j = 0; j < i; j++)
+			if (kdsa_chan[j]->dev_id == kdsa_chan[i]->dev_id)
+				break;
+		if (j == i)
+			evl_dump(m, kdsa_chan[i]);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(errors);
+
+static int __init kdsa_lib_init(void)
+{
+	int i, j;
+	int rc;
+
+	rc = pmu_setup();
+	if (rc)
+		return rc;
+
+	if (emulate)
+		nr_kdsa_chan = lib_emulate_chans();
+	else
+		nr_kdsa_chan = dsa_chan_discover(kdsa_chan, KDSA_MAX_CHAN, 0, 0);
+
+	// Stay loaded without channels; the API then returns -ENODEV
+	if (!nr_kdsa_chan) {
+		printk("kdsa: no DSA channels available\n");
+		return 0;
+	}
+
+	rc = lib_init_cpus();
+	if (rc) {
+		lib_release_chans();
+		return rc;
+	}
+
+	for (i = 0; i < nr_kdsa_chan; i++) {
+		for (j = 0; j < i; j++)
+			if (kdsa_chan[j]->dev_id == kdsa_chan[i]->dev_id)
+				break;
+		dsa_chan_report(kdsa_chan[i], j == i);
+	}
+
+	debugfs_dir = debugfs_create_dir("kdsa", NULL);
+	debugfs_create_file("errors", 0400, debugfs_dir, NULL, &errors_fops);
+
+	printk("kdsa: %d channels, %s backend\n", nr_kdsa_chan, kdsa_chan[0]->backend->name);
+	return 0;
+}
+module_init(kdsa_lib_init);
+
+static void __exit kdsa_lib_exit(void)
+{
+	debugfs_remove_recursive(debugfs_dir);
+	lib_exit_cpus();
+	lib_release_chans();
+}
+module_exit(kdsa_lib_exit);
+
+MODULE_LICENSE("GPL");
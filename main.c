@@ -1,379 +1,2114 @@
+#include <asm/msr.h>
+#include <asm/tsc.h>
 #include <linux/atomic.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/dma-mapping.h>
 #include <linux/init.h>
 #include <linux/kthread.h>
 #include <linux/module.h>
-
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "copy.h"
+#include "dispatch.h"
 #include "driver.h"
+#include "emu.h"
+#include "hist.h"
+#include "kdsa.h"
+#include "pmu.h"
+#include "series.h"
+#include "target.h"
+#include "topo.h"
+#include "tune.h"
+#include "workload.h"
+
+#define MAX_DESC    (4096)
+#define MIN_BLK     (64)
+#define MAX_BLK     (SZ_2M)
+#define MAX_BATCH_DEPTH (16)
+#define MAX_CHAN    (256)
+#define DEFAULT_BLK (512)   // blk_size of bulk runs, which is not tuned
+#define DEFAULT_DESC (512)  // nr_desc without batching, which is not tuned
+
+static int nr_numa;
+module_param(nr_numa, int, 0444);
+MODULE_PARM_DESC(nr_numa, "Maximum number of DSA devices to use, 0 for all; emulation creates one per node (default 0)");
+
+static int nr_chan;
+module_param(nr_chan, int, 0444);
+MODULE_PARM_DESC(nr_chan, "Maximum number of channels (WQs) per DSA device, 0 for all (default 0)");
+
+static int nr_thread;
+module_param(nr_thread, int, 0444);
+MODULE_PARM_DESC(nr_thread, "Number of submitting threads, 0 for one per physical core (default 0)");
+
+static int blk_size;
+module_param(blk_size, int, 0444);
+MODULE_PARM_DESC(blk_size, "Transfer size per descriptor in bytes, 64B-2MB, 0 for the knee of a bandwidth sweep (default 0)");
+
+static int nr_desc;
+module_param(nr_desc, int, 0444);
+MODULE_PARM_DESC(nr_desc, "Descriptors per thread, 1-4096, 0 for the knee of a batch size sweep, or 512 without batching (default 0)");
+
+static bool batch = true;
+module_param(batch, bool, 0444);
+MODULE_PARM_DESC(batch, "Submit descriptors as one BATCH descriptor (default Y)");
+
+static int batch_depth = 2;
+module_param(batch_depth, int, 0444);
+MODULE_PARM_DESC(batch_depth, "Batches kept in flight per thread (default 2)");
+
+static int qdepth;
+module_param(qdepth, int, 0444);
+MODULE_PARM_DESC(qdepth, "Descriptors kept in flight per thread without batching, 0 for nr_desc (default 0)");
+
+static int bulk_size;
+module_param(bulk_size, int, 0444);
+MODULE_PARM_DESC(bulk_size, "Run bulk copies of this many bytes over every channel of the thread's node instead of the workload, 0 to disable (default 0)");
+
+static bool bulk_sg;
+module_param(bulk_sg, bool, 0444);
+MODULE_PARM_DESC(bulk_sg, "Copy the bulk buffers page by page through dsa_copy_sg() on the thread's channel (default N)");
+
+static bool hybrid;
+module_param(hybrid, bool, 0444);
+MODULE_PARM_DESC(hybrid, "Route the bulk copies through the CPU/DSA dispatcher, calibrated on every node before each run (default N)");
+
+static bool emulate;
+module_param(emulate, bool, 0444);
+MODULE_PARM_DESC(emulate, "Run on the software DSA emulator instead of hardware (default N)");
+
+static char target[64];
+module_param_string(target, target, sizeof(target), 0444);
+MODULE_PARM_DESC(target, "Copy into device memory: \"vendor:device[:bar]\" for a PCI BAR, \"local\" for host pages standing in for one, empty for host memory (default empty)");
+
+static bool coalesce;
+module_param(coalesce, bool, 0444);
+MODULE_PARM_DESC(coalesce, "In batch mode, only descriptors with a result to check request a completion record; the others write theirs on error only (default N)");
+
+static bool consume;
+module_param(consume, bool, 0444);
+MODULE_PARM_DESC(consume, "Read the destination of every memmove into host memory after it completes and record how long that takes; needs batch=0 and qdepth=1 (default N)");
+
+static bool pmu;
+module_param(pmu, bool, 0444);
+MODULE_PARM_DESC(pmu, "Sample the device perfmon counters over the run and print them (default N)");
+
+static bool latency;
+module_param(latency, bool, 0444);
+MODULE_PARM_DESC(latency, "Record submit-to-completion latency of every descriptor (batch in batch mode) (default N)");
+
+static int duration_ms = 10000;
+module_param(duration_ms, int, 0444);
+MODULE_PARM_DESC(duration_ms, "Duration of the run in milliseconds (default 10000)");
+
+static int sample_ms = 100;
+module_param(sample_ms, int, 0444);
+MODULE_PARM_DESC(sample_ms, "Interval of the throughput time series in debugfs, 0 to disable (default 100)");
+
+static int warmup_ms = 1000;
+module_param(warmup_ms, int, 0444);
+MODULE_PARM_DESC(warmup_ms, "Start of the run left out of the time series summary (default 1000)");
+
+static bool autorun = true;
+module_param(autorun, bool, 0444);
+MODULE_PARM_DESC(autorun, "Run once with the module parameters while loading; otherwise wait for kdsa_bench/start (default Y)");
+
+struct test_batch {
+	struct dsa_hw_desc batch_desc;
+	struct dsa_completion_record *batch_comp;
+	dma_addr_t desc_list_dma, batch_comp_dma;
+	u64 submit_tsc;
+	bool quarantined;
 
-#define NR_NUMA     (2)
-#define NR_CHAN     (8)
-#define NR_THREAD   (32)
-#define BLK_SIZE    (512)
-#define NR_DESC     (512)
+	// Descriptor list, windows of test_ctx.desc, test_ctx.comp and test_ctx.op
+	struct dsa_hw_desc *desc;
+	struct dsa_completion_record *comp;
+	dma_addr_t comp_dma;
+	u8 *op;
+};
 
-#define A100_BAR1   (0x203000000000)
+struct test_ctx {
+	int nr_slot;
+	struct dsa_hw_desc *desc;
+	u8 *op;
 
-#if (NR_THREAD != 8) && (NR_THREAD != 16) && (NR_THREAD != 32)
-#error Invalid number of threads
-#endif
+	// Completion arena, nr_slot descriptor records then batch_depth batch records
+	struct dsa_completion_record *comp;
+	dma_addr_t comp_dma;
+	size_t comp_size;
 
-#if (NR_DESC % 64 != 0)
-#error Invalid number of descriptors
-#endif
+	// Ring slots, free, in flight or waiting for a late completion
+	int *free_slot, *busy_slot, *quar_slot;
+	int nr_free, nr_busy, nr_quar;
+	u64 *submit_tsc;
 
-#define BATCH
+	// Batches in flight, batch_depth lists of nr_desc descriptors
+	struct test_batch *batch;
 
-struct test_ctx {
-	struct dsa_hw_desc desc[NR_DESC];
-	struct dsa_completion_record *comp[NR_DESC];
-	dma_addr_t comp_dma[NR_DESC];
+	struct workload wl;
+	dma_addr_t dev_dma;	// the thread's window of the target
 
-	struct dsa_hw_desc batch_desc;
-	struct dsa_completion_record *batch_comp;
-	dma_addr_t desc_list_dma, batch_comp_dma;
+	// Bulk copy
+	void *bulk_src, *bulk_dst;
+	struct dsa_chan **bulk_chan;
+	int nr_bulk_chan;
+	struct sg_table bulk_src_sgt, bulk_dst_sgt;
+	struct dispatch *disp;
 
-	void *src, *dst;
-	dma_addr_t src_dma, dst_dma, gpu_dma;
-	struct dma_chan *chan;
+	struct dsa_chan *chan;
+	int cpu, node;
 
 	uint64_t io_cnt;
+	uint64_t op_cnt[WL_NR_OP], op_err[WL_NR_OP];
+	uint64_t timeouts, aborted;
+	struct hist *lat;
+	struct hist *cons;	// consumer reads of the memmove destination
+	u64 cons_sum;
+	struct submit_stats stats;
 } __attribute__((aligned(64)));
 static_assert(sizeof(struct test_ctx) % 64 == 0);
 
-static struct task_struct *threads[NR_THREAD];
-static struct test_ctx ctxs[NR_THREAD];
+static struct task_struct **threads;
+static struct test_ctx *ctxs;
 
-static ktime_t begin_ktime[NR_THREAD];
-static ktime_t end_ktime[NR_THREAD];
+static ktime_t *begin_ktime;
+static ktime_t *end_ktime;
 
 static wait_queue_head_t barrier_waitqueue;
 static atomic_t barrier_cnt = ATOMIC_INIT(0);
 
-static struct dma_chan *dma_chan[NR_NUMA][NR_CHAN];
+// Channels in use, interleaved over their devices
+static struct dsa_chan **dsa_chan;
+static int nr_dsa_chan;
 
-static struct kmem_cache *comp_cache;
+// Perfmon of every device in use, NULL where it has none
+static struct dsa_pmu **dsa_pmu;
+static int nr_dsa_pmu;
 
-static int test_init(int tid)
-{
-	struct test_ctx *ctx;
-	int i;
-	int error;
+// Control plane and results, in debugfs under kdsa_bench/
+static struct dentry *debugfs_dir;
+static struct dentry *series_dentry;
+static struct series *io_series;	// throughput over the last run
 
-	ctx = &ctxs[tid];
+static DEFINE_MUTEX(run_lock);		// serializes config changes against runs
+static struct task_struct *run_task;	// current or last run
+static bool running, run_stop;
+static int run_id, run_rc;
+static DECLARE_WAIT_QUEUE_HEAD(run_waitqueue);
 
-	ctx->io_cnt = 0;
+// key=value lines of the last run
+#define RESULTS_SIZE	(SZ_64K)
 
-	// Channel
-	ctx->chan = dma_chan[0][tid / (NR_THREAD / NR_CHAN)];
+static DEFINE_MUTEX(results_lock);
+static char *results;
+static size_t results_len;
 
-	// Buffer
-	ctx->src = kmalloc(BLK_SIZE, GFP_KERNEL);
-	ctx->dst = kmalloc(BLK_SIZE, GFP_KERNEL);
-	if (!ctx->src || !ctx->dst)
-		goto failure0;
+// Channels of the last run, kept while emulate, nr_numa and nr_chan do not change
+static bool chan_emulate;
+static int chan_nr_numa = -1, chan_nr_chan = -1;
 
-	// IOVA
-	ctx->src_dma = dma_map_single(ctx->chan->device->dev, ctx->src, BLK_SIZE, DMA_BIDIRECTIONAL);
-	ctx->dst_dma = dma_map_single(ctx->chan->device->dev, ctx->dst, BLK_SIZE, DMA_BIDIRECTIONAL);
-	ctx->gpu_dma = dma_map_resource(ctx->chan->device->dev, A100_BAR1 + tid * BLK_SIZE, BLK_SIZE, DMA_BIDIRECTIONAL, 0);
+/*
+ * Knees found on those channels; tuned_blk_size is for transfers up to
+ * tuned_max_blk bytes, tuned_nr_desc for tuned_len-byte transfers
+ */
+static int tuned_blk_size, tuned_nr_desc, tuned_len;
+static u64 tuned_max_blk;
 
-	// IOVA for Batch
-	ctx->desc_list_dma = dma_map_single(ctx->chan->device->dev, ctx->desc, NR_DESC * sizeof(struct dsa_hw_desc), DMA_BIDIRECTIONAL);
+// CPUs in the order threads take them
+static int *plan_cpu;
 
-	// Completion
-	error = 0;
-	for (i = 0; i < NR_DESC; i++) {
-		ctx->comp[i] = kmem_cache_zalloc(comp_cache, GFP_KERNEL);
-		if (!ctx->comp[i])
-			error = 1;
-	}
-	ctx->batch_comp = kmem_cache_zalloc(comp_cache, GFP_KERNEL);
-	if (!ctx->batch_comp)
-		error = 1;
-	if (error)
-		goto failure1;
+// Dispatch thresholds of the run, per node; see test_calibrate()
+static struct dispatch_params *node_calib;
 
-	for (i = 0; i < NR_DESC; i++)
-		ctx->comp_dma[i] = dma_map_single(ctx->chan->device->dev, ctx->comp[i], sizeof(struct dsa_completion_record), DMA_BIDIRECTIONAL);
-	ctx->batch_comp_dma = dma_map_single(ctx->chan->device->dev, ctx->batch_comp, sizeof(struct dsa_completion_record), DMA_BIDIRECTIONAL);
+// Device memory memmove copies into, NULL for host memory
+static struct dsa_target *dev_target;
+static bool dev_target_busy;	// a thread of this run leaked descriptors that may still write it
 
-	return 0;
+// Every thread copies into its own window of the target
+static inline size_t target_window(void)
+{
+	return round_up(blk_size, PAGE_SIZE);
+}
 
-failure1:
-	for (i = 0; i < NR_DESC; i++)
-		if (ctx->comp[i])
-			kmem_cache_free(comp_cache, ctx->comp[i]);
+static inline dma_addr_t comp_dma(dma_addr_t base, int idx)
+{
+	return base + idx * sizeof(struct dsa_completion_record);
+}
 
-failure0:
-	if (ctx->src)
-		kfree(ctx->src);
-	if (ctx->dst)
-		kfree(ctx->dst);
+// The rank-th of the channels on node, wrapping around; NULL if it has none
+static struct dsa_chan *node_chan(int node, int rank)
+{
+	int i, cnt;
 
-	return 1;
+	cnt = 0;
+	for (i = 0; i < nr_dsa_chan; i++)
+		if (dsa_chan[i]->node == node)
+			cnt++;
+	if (!cnt)
+		return NULL;
+
+	rank %= cnt;
+	for (i = 0; i < nr_dsa_chan; i++)
+		if (dsa_chan[i]->node == node && rank-- == 0)
+			return dsa_chan[i];
+
+	return NULL;
 }
 
-static void test_barrier(void)
+// Fills chans with the channels on node, or with all of them if it has none
+static int node_chans(int node, struct dsa_chan **chans)
 {
-	if (atomic_inc_return(&barrier_cnt) == NR_THREAD)
-		wake_up_all(&barrier_waitqueue);
-	else
-		wait_event(barrier_waitqueue, atomic_read(&barrier_cnt) == NR_THREAD);
+	int i, cnt;
+
+	cnt = 0;
+	for (i = 0; i < nr_dsa_chan; i++)
+		if (dsa_chan[i]->node == node)
+			chans[cnt++] = dsa_chan[i];
+	if (!cnt) {
+		memcpy(chans, dsa_chan, nr_dsa_chan * sizeof(*dsa_chan));
+		cnt = nr_dsa_chan;
+	}
+
+	return cnt;
 }
 
-static void test_run(int tid)
+// Reorders the channels round-robin over their devices, one of each per round
+static void interleave_chans(void)
 {
-	struct test_ctx *ctx;
-	int i;
-	int targetted, submitted;
-	int rc;
+	struct dsa_chan **tmp;
+	bool *taken;
+	int i, j, n, round;
+	bool dup;
+
+	tmp = kcalloc(nr_dsa_chan, sizeof(*tmp), GFP_KERNEL);
+	taken = kcalloc(nr_dsa_chan, sizeof(*taken), GFP_KERNEL);
+	if (!tmp || !taken)
+		goto out;
+
+	for (n = 0; n < nr_dsa_chan; ) {
+		round = n;
+		for (i = 0; i < nr_dsa_chan; i++) {
+			if (taken[i])
+				continue;
+
+			dup = false;
+			for (j = round; j < n; j++)
+				if (tmp[j]->dev_id == dsa_chan[i]->dev_id)
+					dup = true;
+			if (dup)
+				continue;
+
+			taken[i] = true;
+			tmp[n++] = dsa_chan[i];
+		}
+	}
+	memcpy(dsa_chan, tmp, nr_dsa_chan * sizeof(*tmp));
 
-	ctx = &ctxs[tid];
+out:
+	kfree(tmp);
+	kfree(taken);
+}
 
-	while (!kthread_should_stop()) {
-#ifndef BATCH
-		targetted = NR_DESC;
+// Emulated devices, one per node unless nr_numa says otherwise
+static int emulate_chans(void)
+{
+	char chan_name[16];
+	int nr_dev, nr;
+	int dev, cid;
+	int node;
+	int n = 0;
+
+	nr_dev = nr_numa ? nr_numa : num_online_nodes();
+	nr = nr_chan ? nr_chan : EMU_NR_CHAN;
+
+	for (dev = 0; dev < nr_dev; dev++) {
+		node = dev < nr_node_ids && node_online(dev) ? dev : NUMA_NO_NODE;
+		for (cid = 0; cid < nr && n < MAX_CHAN; cid++) {
+			snprintf(chan_name, 16, "dma%dchan%d", dev, cid);
+			dsa_chan[n] = dsa_emu_chan_create(chan_name, dev, node);
+			if (dsa_chan[n])
+				n++;
+		}
+	}
 
-		submitted = 0;
+	return n;
+}
 
-		for (i = 0; i < targetted; i++) {
-#if 0
-			// CPU -> CPU
-			prep(&ctx->desc[i], DSA_OPCODE_MEMMOVE, ctx->src_dma, ctx->dst_dma, BLK_SIZE, ctx->comp_dma[i], IDXD_OP_FLAG_RCR | IDXD_OP_FLAG_CRAV);
-#else
-			// CPU -> GPU
-			prep(&ctx->desc[i], DSA_OPCODE_MEMMOVE, ctx->src_dma, ctx->gpu_dma, BLK_SIZE, ctx->comp_dma[i], IDXD_OP_FLAG_RCR | IDXD_OP_FLAG_CRAV);
-#endif
+// One perfmon per device; devices without one are skipped
+static int test_open_pmu(void)
+{
+	struct dsa_pmu *p;
+	int i, j;
 
-			rc = submit(ctx->chan, &ctx->desc[i]);
-			if (rc) {
-				if (unlikely(rc != -EAGAIN))
-					printk("kdsa: fatal: failed to submit desc (rc %d)\n", rc);
+	dsa_pmu = kcalloc(nr_dsa_chan, sizeof(*dsa_pmu), GFP_KERNEL);
+	if (!dsa_pmu)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_dsa_chan; i++) {
+		for (j = 0; j < nr_dsa_pmu; j++)
+			if (dsa_pmu[j]->dev_id == dsa_chan[i]->dev_id)
 				break;
-			}
-			submitted++;
-		}
+		if (j < nr_dsa_pmu)
+			continue;
 
-		/*
-		if (submitted == NR_DESC)
-			printk("kdsa: increase the number of descriptors\n");
-		*/
-
-		for (i = 0; i < submitted; i++) {
-			rc = poll(ctx->comp[i]);
-			if (unlikely(rc != DSA_COMP_SUCCESS))
-				printk("kdsa: fatal: failed to poll (rc %d)\n", rc);
-			else
-				ctx->io_cnt++;
-			ctx->comp[i]->status = 0;
+		p = dsa_pmu_open(dsa_chan[i]);
+		if (IS_ERR(p)) {
+			if (PTR_ERR(p) != -EOPNOTSUPP)
+				return PTR_ERR(p);
+			printk("kdsa: %s has no perfmon\n", dsa_chan[i]->name);
+			continue;
 		}
-#else
-		for (i = 0; i < NR_DESC; i++)
-			prep(&ctx->desc[i], DSA_OPCODE_MEMMOVE, ctx->src_dma, ctx->gpu_dma, BLK_SIZE, ctx->comp_dma[i], IDXD_OP_FLAG_RCR | IDXD_OP_FLAG_CRAV);
-		prep(&ctx->batch_desc, DSA_OPCODE_BATCH, ctx->desc_list_dma, 0, NR_DESC, ctx->batch_comp_dma, IDXD_OP_FLAG_RCR | IDXD_OP_FLAG_CRAV);
+		dsa_pmu[nr_dsa_pmu++] = p;
+	}
 
-		rc = submit(ctx->chan, &ctx->batch_desc);
-		if (rc) {
-			if (unlikely(rc != -11))
-				printk("kdsa: fatal: failed to submit desc (rc %d)\n", rc);
-		} else {
-			rc = poll(ctx->batch_comp);
-			if (unlikely(rc != DSA_COMP_SUCCESS))
-				printk("kdsa: fatal: failed to poll (rc %d)\n", rc);
-			else
-				ctx->io_cnt += NR_DESC;
-
-			for (i = 0; i < NR_DESC; i++)
-				ctx->comp[i]->status = 0;
-			ctx->batch_comp->status = 0;
-		}
-#endif
+	return 0;
+}
+
+/*
+ * Lists the CPUs for the threads: those of the nodes with a DSA device, or
+ * of every node when the devices report none. Without nr_thread, every
+ * physical core gets one thread.
+ */
+static int test_plan(void)
+{
+	nodemask_t nodes;
+	int nr_cpu, nr_core;
+	int i;
+
+	nodes_clear(nodes);
+	for (i = 0; i < nr_dsa_chan; i++)
+		if (dsa_chan[i]->node != NUMA_NO_NODE)
+			node_set(dsa_chan[i]->node, nodes);
+	if (nodes_empty(nodes))
+		nodes = node_online_map;
+
+	plan_cpu = kcalloc(nr_cpu_ids, sizeof(int), GFP_KERNEL);
+	if (!plan_cpu)
+		return -ENOMEM;
+
+	nr_cpu = topo_cpus(plan_cpu, nr_cpu_ids, &nodes, &nr_core);
+	if (!nr_thread)
+		nr_thread = nr_core;
+
+	printk("kdsa: topology:   %d cpus, %d cores on %d nodes, %d channels\n",
+			nr_cpu, nr_core, nodes_weight(nodes), nr_dsa_chan);
+
+	if (nr_thread < 1 || nr_thread > nr_cpu) {
+		printk("kdsa: cannot place %d threads on %d cpus\n", nr_thread, nr_cpu);
+		return -EINVAL;
 	}
+
+	return 0;
 }
 
-static void test_exit(int tid)
+/*
+ * Pins every thread to its CPU in the plan and spreads the threads of a node
+ * over the channels on that node, so that neither descriptors nor data cross
+ * the socket interconnect unless the node has no device.
+ */
+static void test_place(void)
 {
 	struct test_ctx *ctx;
+	int tid, i, rank;
+
+	for (tid = 0; tid < nr_thread; tid++) {
+		ctx = &ctxs[tid];
+		ctx->cpu = plan_cpu[tid];
+		ctx->node = cpu_to_node(ctx->cpu);
+
+		rank = 0;
+		for (i = 0; i < tid; i++)
+			if (ctxs[i].node == ctx->node)
+				rank++;
+
+		ctx->chan = node_chan(ctx->node, rank);
+		if (!ctx->chan)
+			ctx->chan = dsa_chan[tid % nr_dsa_chan];
+
+		printk("kdsa: thread %2d:  cpu %d (node %d%s), %s (node %d, %s)\n",
+				tid, ctx->cpu, ctx->node, topo_smt(ctx->cpu) ? ", smt" : "",
+				ctx->chan->name, ctx->chan->node, ctx->chan->dedicated ? "dedicated" : "shared");
+	}
+}
+
+// One entry per page, as a page cache or bio caller would pass them
+static int test_init_sgt(struct sg_table *sgt, void *buf)
+{
+	struct scatterlist *sg;
 	int i;
 
-	ctx = &ctxs[tid];
+	if (sg_alloc_table(sgt, DIV_ROUND_UP(bulk_size, PAGE_SIZE), GFP_KERNEL))
+		return 1;
 
-	// Completion
-	for (i = 0; i < NR_DESC; i++) {
-		dma_unmap_single(ctx->chan->device->dev, ctx->comp_dma[i], sizeof(struct dsa_completion_record), DMA_BIDIRECTIONAL);
-		kmem_cache_free(comp_cache, ctx->comp[i]);
+	for_each_sgtable_sg(sgt, sg, i)
+		sg_set_buf(sg, buf + i * PAGE_SIZE, min_t(int, bulk_size - i * PAGE_SIZE, PAGE_SIZE));
+
+	return 0;
+}
+
+// Buffers of the bulk copy and the channels on the thread's node, or all of them
+static int test_init_bulk(struct test_ctx *ctx)
+{
+	ctx->bulk_chan = kcalloc_node(nr_dsa_chan, sizeof(*ctx->bulk_chan), GFP_KERNEL, ctx->node);
+	if (!ctx->bulk_chan)
+		return 1;
+	ctx->nr_bulk_chan = node_chans(ctx->node, ctx->bulk_chan);
+
+	ctx->bulk_src = alloc_pages_exact_nid(ctx->node, bulk_size, GFP_KERNEL | __GFP_NOWARN);
+	ctx->bulk_dst = alloc_pages_exact_nid(ctx->node, bulk_size, GFP_KERNEL | __GFP_NOWARN);
+	if (!ctx->bulk_src || !ctx->bulk_dst) {
+		printk("kdsa: failed to allocate %d contiguous bytes for the bulk copy\n", bulk_size);
+		return 1;
 	}
-	dma_unmap_single(ctx->chan->device->dev, ctx->batch_comp_dma, sizeof(struct dsa_completion_record), DMA_BIDIRECTIONAL);
-	kmem_cache_free(comp_cache, ctx->batch_comp);
+	memset(ctx->bulk_src, 0x5a, bulk_size);
 
-	// IOVA for Batch
-	dma_unmap_single(ctx->chan->device->dev, ctx->desc_list_dma, NR_DESC * sizeof(struct dsa_hw_desc), DMA_BIDIRECTIONAL);
+	if (bulk_sg) {
+		if (test_init_sgt(&ctx->bulk_src_sgt, ctx->bulk_src) ||
+		    test_init_sgt(&ctx->bulk_dst_sgt, ctx->bulk_dst))
+			return 1;
+	}
 
-	// IOVA
-	dma_unmap_single(ctx->chan->device->dev, ctx->src_dma, BLK_SIZE, DMA_BIDIRECTIONAL);
-	dma_unmap_single(ctx->chan->device->dev, ctx->dst_dma, BLK_SIZE, DMA_BIDIRECTIONAL);
-	dma_unmap_resource(ctx->chan->device->dev, ctx->gpu_dma, BLK_SIZE, DMA_BIDIRECTIONAL, 0);
+	if (hybrid) {
+		ctx->disp = dsa_dispatch_create(ctx->bulk_chan, ctx->nr_bulk_chan, ctx->node, &node_calib[ctx->node]);
+		if (!ctx->disp)
+			return 1;
+	}
 
-	// Buffer
-	kfree(ctx->src);
-	kfree(ctx->dst);
+	return 0;
 }
 
-static int test(void *data)
+static void test_exit_bulk(struct test_ctx *ctx)
 {
-	int tid;
-	int rc;
+	dsa_dispatch_destroy(ctx->disp);
+	ctx->disp = NULL;
+
+	if (ctx->bulk_src)
+		free_pages_exact(ctx->bulk_src, bulk_size);
+	if (ctx->bulk_dst)
+		free_pages_exact(ctx->bulk_dst, bulk_size);
+	kfree(ctx->bulk_chan);
+	sg_free_table(&ctx->bulk_src_sgt);
+	sg_free_table(&ctx->bulk_dst_sgt);
+
+	ctx->bulk_src = ctx->bulk_dst = NULL;
+	ctx->bulk_chan = NULL;
+}
 
-	tid = (int)(long)data;
-	rc = 0;
+static int test_init(int tid)
+{
+	struct test_ctx *ctx;
+	struct test_batch *b;
+	int k;
 
-	if (test_init(tid)) {
-		rc = 1;
-		goto failure;
+	ctx = &ctxs[tid];
+
+	ctx->io_cnt = 0;
+	memset(ctx->op_cnt, 0, sizeof(ctx->op_cnt));
+	memset(ctx->op_err, 0, sizeof(ctx->op_err));
+	ctx->timeouts = 0;
+	ctx->aborted = 0;
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+	ctx->nr_quar = 0;
+	ctx->nr_slot = batch ? nr_desc * batch_depth : nr_desc;
+
+	// Channel, picked by test_place()
+	if (!ctx->chan)
+		return 1;
+
+	// Descriptor; everything below lives on the thread's node
+	ctx->desc = kcalloc_node(ctx->nr_slot, sizeof(struct dsa_hw_desc), GFP_KERNEL, ctx->node);
+	ctx->op = kcalloc_node(ctx->nr_slot, sizeof(u8), GFP_KERNEL, ctx->node);
+	ctx->free_slot = kcalloc_node(ctx->nr_slot, sizeof(int), GFP_KERNEL, ctx->node);
+	ctx->busy_slot = kcalloc_node(ctx->nr_slot, sizeof(int), GFP_KERNEL, ctx->node);
+	ctx->quar_slot = kcalloc_node(ctx->nr_slot, sizeof(int), GFP_KERNEL, ctx->node);
+	ctx->submit_tsc = kcalloc_node(ctx->nr_slot, sizeof(u64), GFP_KERNEL, ctx->node);
+	ctx->batch = kcalloc_node(batch_depth, sizeof(struct test_batch), GFP_KERNEL, ctx->node);
+	if (!ctx->desc || !ctx->op || !ctx->free_slot || !ctx->busy_slot || !ctx->quar_slot || !ctx->submit_tsc || !ctx->batch)
+		goto failure0;
+
+	// Latency
+	ctx->lat = kzalloc_node(sizeof(struct hist), GFP_KERNEL, ctx->node);
+	ctx->cons = kzalloc_node(sizeof(struct hist), GFP_KERNEL, ctx->node);
+	if (!ctx->lat || !ctx->cons)
+		goto failure0;
+
+	// Buffer
+	if (wl_init(&ctx->wl, ctx->chan, blk_size, ctx->node))
+		goto failure0;
+
+	// IOVA; without a target, memmove copies CPU -> CPU
+	ctx->dev_dma = ctx->wl.dma[WL_DST];
+	if (dev_target) {
+		ctx->dev_dma = dsa_target_map(dev_target, ctx->chan, tid * target_window(), blk_size);
+		if (ctx->dev_dma == DMA_MAPPING_ERROR) {
+			printk("kdsa: %s cannot reach target %s\n", ctx->chan->name, dev_target->name);
+			ctx->dev_dma = ctx->wl.dma[WL_DST];
+			goto failure1;
+		}
 	}
+	ctx->wl.copy_dst = ctx->dev_dma;
 
-	test_barrier();
+	// Completion; page aligned, so every 32-byte record is aligned as well
+	ctx->comp_size = (ctx->nr_slot + batch_depth) * sizeof(struct dsa_completion_record);
+	ctx->comp = alloc_pages_exact_nid(ctx->node, ctx->comp_size, GFP_KERNEL | __GFP_ZERO);
+	if (!ctx->comp)
+		goto failure1;
+	ctx->comp_dma = chan_map(ctx->chan, ctx->comp, ctx->comp_size);
+
+	// Bulk copy
+	if (bulk_size && test_init_bulk(ctx))
+		goto failure2;
+
+	// Batch
+	for (k = 0; batch && k < batch_depth; k++) {
+		b = &ctx->batch[k];
+		b->desc = &ctx->desc[k * nr_desc];
+		b->op = &ctx->op[k * nr_desc];
+		b->comp = &ctx->comp[k * nr_desc];
+		b->comp_dma = comp_dma(ctx->comp_dma, k * nr_desc);
+		b->batch_comp = &ctx->comp[ctx->nr_slot + k];
+		b->batch_comp_dma = comp_dma(ctx->comp_dma, ctx->nr_slot + k);
+		b->desc_list_dma = chan_map(ctx->chan, b->desc, nr_desc * sizeof(struct dsa_hw_desc));
+	}
 
-	begin_ktime[tid] = ktime_get();
-	test_run(tid);
-	end_ktime[tid] = ktime_get();
+	return 0;
 
-	test_exit(tid);
+failure2:
+	test_exit_bulk(ctx);
+	chan_unmap(ctx->chan, ctx->comp_dma, ctx->comp_size);
+	free_pages_exact(ctx->comp, ctx->comp_size);
 
-failure:
-	while (!kthread_should_stop())
-		cond_resched();
+failure1:
+	if (ctx->dev_dma != ctx->wl.dma[WL_DST])
+		dsa_target_unmap(dev_target, ctx->chan, ctx->dev_dma, blk_size);
+	wl_exit(&ctx->wl);
 
-	return rc;
+failure0:
+	kfree(ctx->desc);
+	kfree(ctx->op);
+	kfree(ctx->free_slot);
+	kfree(ctx->busy_slot);
+	kfree(ctx->quar_slot);
+	kfree(ctx->submit_tsc);
+	kfree(ctx->batch);
+	kfree(ctx->lat);
+	kfree(ctx->cons);
+	ctx->lat = NULL;
+	ctx->cons = NULL;
+
+	return 1;
 }
 
-static bool filter(struct dma_chan *chan, void *param)
+// Completions so far of every thread, for the time series
+static void test_read_io(u64 *col, void *arg)
 {
-	const char *wanted = param;
-	const char *name = dma_chan_name(chan);
-	return strcmp(name, wanted) == 0;
+	int tid;
+
+	for (tid = 0; tid < nr_thread; tid++)
+		col[tid] = READ_ONCE(ctxs[tid].io_cnt);
 }
 
-static struct dma_chan *request_channel(const char *chan_name)
+static int test_init_series(void)
 {
-	dma_cap_mask_t mask;
-	struct dma_chan *chan;
+	io_series = series_create(nr_thread, duration_ms / sample_ms + 2, bulk_size ? bulk_size : blk_size,
+			sample_ms, warmup_ms, test_read_io, NULL);
+	if (!io_series)
+		return -ENOMEM;
 
-	dma_cap_zero(mask);
-	dma_cap_set(DMA_MEMCPY, mask);
+	series_dentry = debugfs_create_file("series", 0444, debugfs_dir, io_series, &series_fops);
+	return 0;
+}
 
-	chan = dma_request_channel(mask, filter, (void *)chan_name);
-	if (!chan) {
-		printk("kdsa: failed to request channel %s\n", chan_name);
-		return NULL;
-	}
+// The last thread in starts the counters, so that they see the first descriptor
+static void test_barrier(void)
+{
+	int i;
 
-	return chan;
+	if (atomic_inc_return(&barrier_cnt) == nr_thread) {
+		for (i = 0; i < nr_dsa_pmu; i++)
+			dsa_pmu_start(dsa_pmu[i]);
+		wake_up_all(&barrier_waitqueue);
+	} else
+		wait_event(barrier_waitqueue, atomic_read(&barrier_cnt) == nr_thread);
 }
 
-static long long int find_min_max(long long int *arr, int len, int is_max)
+// Accounts a descriptor whose record landed
+static inline void test_count(struct test_ctx *ctx, int op)
 {
+	ctx->io_cnt++;
+	ctx->op_cnt[op]++;
+}
+
+/*
+ * Reads the memmove destination the way its consumer would. The time shows
+ * whether the device left the data in the LLC or in memory (see dst_cache).
+ * check_params() keeps a single descriptor in flight, so the read is the
+ * first since the device wrote the buffer and none rewrites it meanwhile.
+ */
+static void test_consume(struct test_ctx *ctx)
+{
+	const u64 *dst = ctx->wl.buf[WL_DST];
+	u64 tsc, sum = 0;
 	int i;
-	long long int tmp = arr[0];
 
-	for (i = 1; i < len; i++) {
-		if (is_max)
-			tmp = max(tmp, arr[i]);
-		else
-			tmp = min(tmp, arr[i]);
+	// Device memory is not the consumer's to read
+	if (ctx->wl.copy_dst != ctx->wl.dma[WL_DST])
+		return;
+
+	tsc = rdtsc_ordered();
+	for (i = 0; i < blk_size / sizeof(u64); i++)
+		sum += READ_ONCE(dst[i]);
+	hist_record(ctx->cons, rdtsc_ordered() - tsc);
+
+	ctx->cons_sum += sum;
+}
+
+static void test_complete(struct test_ctx *ctx, int op, struct dsa_completion_record *comp)
+{
+	// Drained before it ran, by this thread or another one on a shared WQ
+	if (unlikely(comp_aborted(comp))) {
+		ctx->aborted++;
+		return;
 	}
 
-	return tmp;
+	if (likely(wl_check(&ctx->wl, op, comp))) {
+		test_count(ctx, op);
+		if (consume && op == WL_MEMMOVE)
+			test_consume(ctx);
+		return;
+	}
+
+	ctx->op_err[op]++;
+	printk_ratelimited("kdsa: %s failed (status %#x, result %u)\n", wl_name(op), comp->status, comp->result);
 }
 
-static int __init kdsa_init(void)
+// Drains the WQ after a timeout; returns 0 once nothing in flight can land
+static int test_recover(struct test_ctx *ctx)
 {
-	char chan_name[16];
-	int nid, cid;
-	int tid;
 	int rc;
-	long long int begin[NR_THREAD];
-	long long int end[NR_THREAD];
-	long long int b, e;
-	long long int total_io_cnt;
-	long long int elapsed_ns;
 
-	// Channel
-	for (nid = 0; nid < NR_NUMA; nid++)
-		for (cid = 0; cid < NR_CHAN; cid++) {
-			snprintf(chan_name, 16, "dma%dchan%d", nid, cid);
-			dma_chan[nid][cid] = request_channel(chan_name);
-		}
+	ctx->timeouts++;
+	rc = chan_drain(ctx->chan);
+	if (rc)
+		printk("kdsa: %s: descriptor timed out and the WQ did not drain (rc %d)\n", ctx->chan->name, rc);
+	else
+		printk("kdsa: %s: descriptor timed out, WQ drained\n", ctx->chan->name);
 
-	// Barrier
-	init_waitqueue_head(&barrier_waitqueue);
+	return rc;
+}
 
-	// Completion cache
-	comp_cache = kmem_cache_create("kdsa_comp", sizeof(struct dsa_completion_record), 0, SLAB_HWCACHE_ALIGN, NULL);
+/*
+ * Settles every slot in flight after a timeout. Once the WQ is drained, a slot
+ * without a record was aborted and can be reused, as can one whose record
+ * says so (see test_complete()). Otherwise the device may still write it, so
+ * it is quarantined until its record lands.
+ */
+static void test_recover_ring(struct test_ctx *ctx)
+{
+	int drained;
+	int i, slot;
+	int rc;
 
-	// Create threads
-	for (tid = 0; tid < NR_THREAD; tid++) {
-		threads[tid] = kthread_create(test, (void *)(long)tid, "kdsa_thread%d", tid);
-		if (IS_ERR(threads[tid])) {
-			printk("kdsa: failed to create thread %d\n", tid);
-			threads[tid] = NULL;
+	drained = !test_recover(ctx);
+
+	for (i = 0; i < ctx->nr_busy; i++) {
+		slot = ctx->busy_slot[i];
+		rc = peek(&ctx->comp[slot]);
+		if (!rc && !drained) {
+			ctx->quar_slot[ctx->nr_quar++] = slot;
 			continue;
 		}
 
-		kthread_bind(threads[tid], tid < 16 ? tid : tid + 16);
-		wake_up_process(threads[tid]);
+		if (rc)
+			test_complete(ctx, ctx->op[slot], &ctx->comp[slot]);
+		else
+			ctx->aborted++;
+		ctx->comp[slot].status = 0;
+		ctx->free_slot[ctx->nr_free++] = slot;
 	}
+	ctx->nr_busy = 0;
+}
 
-	msleep(10000);
+// Whether a descriptor in flight has waited longer than timeout cycles
+static bool test_expired(struct test_ctx *ctx, u64 timeout)
+{
+	u64 now = rdtsc_ordered();
+	int i;
 
-	// Stop threads
-	rc = 0;
-	for (tid = 0; tid < NR_THREAD; tid++) {
-		if (IS_ERR_OR_NULL(threads[tid]))
-			rc = -EINVAL;
-		else if (kthread_stop(threads[tid]))
-			rc = -ENOMEM;
-	}
+	for (i = 0; i < ctx->nr_busy; i++)
+		if (now - ctx->submit_tsc[ctx->busy_slot[i]] > timeout)
+			return true;
 
-	// Result
-	if (!rc) {
-		for (tid = 0; tid < NR_THREAD; tid++) {
-			begin[tid] = ktime_to_ns(begin_ktime[tid]);
-			end[tid] = ktime_to_ns(end_ktime[tid]);
+	return false;
+}
+
+/*
+ * Keeps up to qdepth descriptors in flight. Completions are reaped in whatever
+ * order they land and their slots are refilled on the next pass, so the WQ
+ * never drains between iterations.
+ */
+static void test_run_ring(struct test_ctx *ctx)
+{
+	int depth = qdepth ? qdepth : nr_desc;
+	u64 timeout = div_u64(dsa_comp_timeout_ns() * tsc_khz, NSEC_PER_MSEC);
+	int i, slot;
+	int progress;
+	int rc;
+
+	for (i = 0; i < depth; i++)
+		ctx->free_slot[i] = i;
+	ctx->nr_free = depth;
+	ctx->nr_busy = 0;
+
+	while (!kthread_should_stop()) {
+		progress = 0;
+
+		// Refill
+		while (ctx->nr_free) {
+			slot = ctx->free_slot[ctx->nr_free - 1];
+			ctx->op[slot] = wl_next(&ctx->wl);
+			wl_prep(&ctx->wl, &ctx->desc[slot], ctx->op[slot], comp_dma(ctx->comp_dma, slot), dsa_comp_flags());
+
+			ctx->submit_tsc[slot] = rdtsc_ordered();
+			rc = dsa_submit(ctx->chan, &ctx->desc[slot], &ctx->comp[slot], &ctx->stats);
+			if (rc) {
+				if (unlikely(rc != -EAGAIN))
+					printk("kdsa: fatal: failed to submit desc (rc %d)\n", rc);
+				break;
+			}
+			ctx->nr_free--;
+			ctx->busy_slot[ctx->nr_busy++] = slot;
+			progress++;
 		}
 
-		b = find_min_max(begin, NR_THREAD, 0);
-		e = find_min_max(end, NR_THREAD, 1);
+		// Reap
+		for (i = 0; i < ctx->nr_busy; ) {
+			slot = ctx->busy_slot[i];
+			rc = peek(&ctx->comp[slot]);
+			if (!rc) {
+				i++;
+				continue;
+			}
 
-		total_io_cnt = 0;
-		for (tid = 0; tid < NR_THREAD; tid++)
-			total_io_cnt += ctxs[tid].io_cnt;
-		elapsed_ns = e - b;
+			if (latency)
+				hist_record(ctx->lat, rdtsc_ordered() - ctx->submit_tsc[slot]);
+			test_complete(ctx, ctx->op[slot], &ctx->comp[slot]);
+			ctx->comp[slot].status = 0;
 
-		printk("kdsa: ======== Result ========\n");
-		printk("kdsa: io:         %lld\n", total_io_cnt);
-		printk("kdsa: elapsed:    %lld μs\n", elapsed_ns / 1000);
-		printk("kdsa: bandwidth:  %lld.%03lld MIOPS\n",
-				(total_io_cnt * 1000) / elapsed_ns,
-				((total_io_cnt * 1000000) / elapsed_ns) % 1000);
-	} else {
-		printk("kdsa: failed to test\n");
+			ctx->busy_slot[i] = ctx->busy_slot[--ctx->nr_busy];
+			ctx->free_slot[ctx->nr_free++] = slot;
+			progress++;
+		}
+
+		// Late completions release quarantined slots
+		for (i = 0; i < ctx->nr_quar; ) {
+			slot = ctx->quar_slot[i];
+			rc = peek(&ctx->comp[slot]);
+			if (!rc) {
+				i++;
+				continue;
+			}
+
+			test_complete(ctx, ctx->op[slot], &ctx->comp[slot]);
+			ctx->comp[slot].status = 0;
+
+			ctx->quar_slot[i] = ctx->quar_slot[--ctx->nr_quar];
+			ctx->free_slot[ctx->nr_free++] = slot;
+			progress++;
+		}
+
+		if (progress || !ctx->nr_busy)
+			continue;
+
+		if (unlikely(test_expired(ctx, timeout)))
+			test_recover_ring(ctx);
+		else
+			dsa_comp_wait(ctx->chan, &ctx->comp[ctx->busy_slot[0]]);
 	}
 
-	// Completion cache
-	kmem_cache_destroy(comp_cache);
+	// Drain before the buffers are unmapped
+	while (ctx->nr_busy) {
+		slot = ctx->busy_slot[ctx->nr_busy - 1];
+		rc = dsa_poll(ctx->chan, &ctx->comp[slot]);
+		if (rc < 0) {
+			test_recover_ring(ctx);
+			break;
+		}
+
+		test_complete(ctx, ctx->op[slot], &ctx->comp[slot]);
+		ctx->comp[slot].status = 0;
 
-	// Channel
-	for (nid = 0; nid < NR_NUMA; nid++)
-		for (cid = 0; cid < NR_CHAN; cid++)
-			if (dma_chan[nid][cid])
-				dma_release_channel(dma_chan[nid][cid]);
+		ctx->nr_busy--;
+		ctx->free_slot[ctx->nr_free++] = slot;
+	}
+}
+
+static int test_submit_batch(struct test_ctx *ctx, struct test_batch *b)
+{
+	u32 flags;
+	int i;
+
+	for (i = 0; i < nr_desc; i++) {
+		b->op[i] = wl_next(&ctx->wl);
+
+		// CRAV alone still gets the record written if the descriptor fails
+		flags = IDXD_OP_FLAG_CRAV;
+		if (!coalesce || wl_has_result(b->op[i]))
+			flags |= IDXD_OP_FLAG_RCR;
+		wl_prep(&ctx->wl, &b->desc[i], b->op[i], comp_dma(b->comp_dma, i), flags);
+	}
+	dsa_prep(&b->batch_desc, DSA_OPCODE_BATCH, b->desc_list_dma, 0, nr_desc, b->batch_comp_dma, dsa_comp_flags());
 
-	// rc == 0 means success; the return code is intentional to avoid rmmod
-	return rc ? rc : -EPERM;
+	if (latency)
+		b->submit_tsc = rdtsc_ordered();
+	return dsa_submit(ctx->chan, &b->batch_desc, b->batch_comp, &ctx->stats);
 }
-module_init(kdsa_init);
+
+// Returns -ETIMEDOUT if the batch timed out and the WQ could not be drained
+static int test_reap_batch(struct test_ctx *ctx, struct test_batch *b)
+{
+	int i;
+	int rc;
+
+	rc = dsa_poll(ctx->chan, b->batch_comp);
+	if (unlikely(rc < 0)) {
+		if (test_recover(ctx))
+			return -ETIMEDOUT;
+		rc = peek(b->batch_comp);
+	}
+
+	if (latency)
+		hist_record(ctx->lat, rdtsc_ordered() - b->submit_tsc);
+	if (likely(rc == DSA_COMP_SUCCESS || rc == DSA_COMP_BATCH_FAIL)) {
+		// A failed batch still ran every descriptor
+		for (i = 0; i < nr_desc; i++) {
+			// A coalesced record is only there if its descriptor failed
+			if (coalesce && !wl_has_result(b->op[i]) &&
+			    (rc == DSA_COMP_SUCCESS || !b->comp[i].status)) {
+				test_count(ctx, b->op[i]);
+				continue;
+			}
+
+			test_complete(ctx, b->op[i], &b->comp[i]);
+			b->comp[i].status = 0;
+		}
+	} else {
+		if (!rc || comp_aborted(b->batch_comp)) {
+			// Drained; a batch without a record, or with an aborted one, never ran
+			ctx->aborted++;
+		} else {
+			printk("kdsa: fatal: failed to poll (rc %d)\n", rc);
+		}
+
+		for (i = 0; i < nr_desc; i++)
+			b->comp[i].status = 0;
+	}
+	b->batch_comp->status = 0;
+
+	return 0;
+}
+
+/*
+ * Keeps up to batch_depth batches in flight. While the oldest batch executes,
+ * the ones behind it are already queued, and a reaped batch is prepared and
+ * resubmitted right away.
+ */
+static void test_run_batch(struct test_ctx *ctx)
+{
+	unsigned int head = 0, tail = 0;
+	int rc;
+
+	while (!kthread_should_stop()) {
+		// Fill the pipeline
+		while (tail - head < batch_depth) {
+			rc = test_submit_batch(ctx, &ctx->batch[tail % batch_depth]);
+			if (rc) {
+				if (unlikely(rc != -EAGAIN))
+					printk("kdsa: fatal: failed to submit desc (rc %d)\n", rc);
+				break;
+			}
+			tail++;
+		}
+
+		if (head == tail)
+			continue;
+
+		// Reap the oldest batch
+		if (test_reap_batch(ctx, &ctx->batch[head % batch_depth]))
+			goto stalled;
+		head++;
+	}
+
+	// Drain before the buffers are unmapped
+	for (; head != tail; head++)
+		if (test_reap_batch(ctx, &ctx->batch[head % batch_depth]))
+			goto stalled;
+
+	return;
+
+stalled:
+	// The device may still run these batches, so none of them can be reused
+	for (; head != tail; head++) {
+		ctx->batch[head % batch_depth].quarantined = true;
+		ctx->nr_quar++;
+	}
+}
+
+// Copies bulk_size bytes per call; io_cnt counts the copies
+static void test_run_bulk(struct test_ctx *ctx)
+{
+	u64 tsc;
+	int rc;
+
+	while (!kthread_should_stop()) {
+		tsc = rdtsc_ordered();
+		if (hybrid)
+			rc = dsa_dispatch_copy(ctx->disp, ctx->bulk_dst, ctx->bulk_src, bulk_size);
+		else if (bulk_sg)
+			rc = dsa_copy_sg(ctx->chan, &ctx->bulk_dst_sgt, &ctx->bulk_src_sgt);
+		else
+			rc = dsa_copy_bulk(ctx->bulk_chan, ctx->nr_bulk_chan, ctx->bulk_dst, ctx->bulk_src, bulk_size);
+		if (unlikely(rc)) {
+			printk("kdsa: fatal: bulk copy failed (rc %d)\n", rc);
+			// The device may still write the destination
+			if (rc == -ETIMEDOUT)
+				ctx->nr_quar++;
+			break;
+		}
+
+		if (latency)
+			hist_record(ctx->lat, rdtsc_ordered() - tsc);
+		ctx->io_cnt++;
+	}
+}
+
+static void test_run(int tid)
+{
+	struct test_ctx *ctx;
+
+	ctx = &ctxs[tid];
+
+	if (bulk_size)
+		test_run_bulk(ctx);
+	else if (batch)
+		test_run_batch(ctx);
+	else
+		test_run_ring(ctx);
+}
+
+// Number of quarantined descriptors or batches whose record never landed
+static int test_outstanding(struct test_ctx *ctx)
+{
+	int cnt = 0;
+	int i, k;
+
+	if (bulk_size) {
+		cnt = ctx->nr_quar;
+	} else if (batch) {
+		for (k = 0; k < batch_depth; k++)
+			if (ctx->batch[k].quarantined && !peek(ctx->batch[k].batch_comp))
+				cnt++;
+	} else {
+		for (i = 0; i < ctx->nr_quar; i++)
+			if (!peek(&ctx->comp[ctx->quar_slot[i]]))
+				cnt++;
+	}
+
+	return cnt;
+}
+
+static void test_exit(int tid)
+{
+	struct test_ctx *ctx;
+	int cnt;
+	int k;
+
+	ctx = &ctxs[tid];
+
+	// The device may still access these; leak them rather than risk corruption
+	cnt = test_outstanding(ctx);
+	if (cnt) {
+		printk("kdsa: thread %d: %d never completed, leaking its buffers\n", tid, cnt);
+		dev_target_busy = true;
+		goto out;
+	}
+
+	// Batch
+	for (k = 0; batch && k < batch_depth; k++)
+		chan_unmap(ctx->chan, ctx->batch[k].desc_list_dma, nr_desc * sizeof(struct dsa_hw_desc));
+
+	// Bulk copy
+	test_exit_bulk(ctx);
+
+	// Completion
+	chan_unmap(ctx->chan, ctx->comp_dma, ctx->comp_size);
+	free_pages_exact(ctx->comp, ctx->comp_size);
+
+	// IOVA
+	if (ctx->dev_dma != ctx->wl.dma[WL_DST])
+		dsa_target_unmap(dev_target, ctx->chan, ctx->dev_dma, blk_size);
+
+	// Buffer
+	wl_exit(&ctx->wl);
+
+	// Descriptor
+	kfree(ctx->desc);
+	kfree(ctx->op);
+
+out:
+	kfree(ctx->bulk_chan);
+	kfree(ctx->free_slot);
+	kfree(ctx->busy_slot);
+	kfree(ctx->quar_slot);
+	kfree(ctx->submit_tsc);
+	kfree(ctx->batch);
+}
+
+static int test(void *data)
+{
+	int tid;
+	int rc;
+
+	tid = (int)(long)data;
+	rc = 0;
+
+	if (test_init(tid)) {
+		// Release the others; the run is reported as failed anyway
+		test_barrier();
+		rc = 1;
+		goto failure;
+	}
+
+	test_barrier();
+
+	begin_ktime[tid] = ktime_get();
+	test_run(tid);
+	end_ktime[tid] = ktime_get();
+
+	test_exit(tid);
+
+failure:
+	while (!kthread_should_stop())
+		cond_resched();
+
+	return rc;
+}
+
+static __printf(1, 2) void result(const char *fmt, ...)
+{
+	va_list args;
+
+	mutex_lock(&results_lock);
+	va_start(args, fmt);
+	results_len += vscnprintf(results + results_len, RESULTS_SIZE - results_len, fmt, args);
+	va_end(args);
+	mutex_unlock(&results_lock);
+}
+
+static long long int find_min_max(long long int *arr, int len, int is_max)
+{
+	int i;
+	long long int tmp = arr[0];
+
+	for (i = 1; i < len; i++) {
+		if (is_max)
+			tmp = max(tmp, arr[i]);
+		else
+			tmp = min(tmp, arr[i]);
+	}
+
+	return tmp;
+}
+
+static u64 tsc_to_ns(u64 cycles)
+{
+	return div_u64(cycles * 1000000, tsc_khz);
+}
+
+static void print_ops(long long int elapsed_ns)
+{
+	u64 cnt, err;
+	int op, tid;
+
+	for (op = 0; op < WL_NR_OP; op++) {
+		if (!wl_enabled(op))
+			continue;
+
+		cnt = err = 0;
+		for (tid = 0; tid < nr_thread; tid++) {
+			cnt += ctxs[tid].op_cnt[op];
+			err += ctxs[tid].op_err[op];
+		}
+
+		printk("kdsa: %-10s  io %llu, %llu.%03llu MIOPS, %llu MB/s, errors %llu\n",
+				wl_name(op), cnt,
+				div64_u64(cnt * 1000, elapsed_ns),
+				div64_u64(cnt * 1000000, elapsed_ns) % 1000,
+				div64_u64(cnt * blk_size * 1000, elapsed_ns),
+				err);
+		result("%s_io=%llu\n%s_errors=%llu\n", wl_name(op), cnt, wl_name(op), err);
+	}
+}
+
+static void print_nodes(long long int elapsed_ns)
+{
+	u64 cnt;
+	int node, tid, nr;
+
+	for (node = 0; node < nr_node_ids; node++) {
+		cnt = nr = 0;
+		for (tid = 0; tid < nr_thread; tid++) {
+			if (ctxs[tid].node != node)
+				continue;
+			cnt += ctxs[tid].io_cnt;
+			nr++;
+		}
+		if (!nr)
+			continue;
+
+		printk("kdsa: node %d:     threads %d, io %llu, %llu.%03llu MIOPS\n",
+				node, nr, cnt,
+				div64_u64(cnt * 1000, elapsed_ns),
+				div64_u64(cnt * 1000000, elapsed_ns) % 1000);
+		result("node%d_threads=%d\nnode%d_io=%llu\n", node, nr, node, cnt);
+	}
+}
+
+static void print_hist(const char *label, const char *key, const struct hist *h, const char *per)
+{
+	printk("kdsa: %-12sp50 %llu, p90 %llu, p99 %llu, p99.9 %llu, max %llu ns (%s, %llu samples)\n",
+			label,
+			tsc_to_ns(hist_percentile(h, 50000)),
+			tsc_to_ns(hist_percentile(h, 90000)),
+			tsc_to_ns(hist_percentile(h, 99000)),
+			tsc_to_ns(hist_percentile(h, 99900)),
+			tsc_to_ns(h->max),
+			per, h->total);
+	result("%s_p50_ns=%llu\n%s_p90_ns=%llu\n%s_p99_ns=%llu\n%s_p999_ns=%llu\n%s_max_ns=%llu\n%s_samples=%llu\n",
+			key, tsc_to_ns(hist_percentile(h, 50000)),
+			key, tsc_to_ns(hist_percentile(h, 90000)),
+			key, tsc_to_ns(hist_percentile(h, 99000)),
+			key, tsc_to_ns(hist_percentile(h, 99900)),
+			key, tsc_to_ns(h->max),
+			key, h->total);
+}
+
+static void print_latency(void)
+{
+	struct hist *h;
+	int tid;
+
+	h = kzalloc(sizeof(struct hist), GFP_KERNEL);
+	if (!h)
+		return;
+
+	for (tid = 0; tid < nr_thread; tid++)
+		hist_merge(h, ctxs[tid].lat);
+	print_hist("latency:", "latency", h, bulk_size ? "per copy" : batch ? "per batch" : "per desc");
+
+	kfree(h);
+}
+
+static void print_consume(void)
+{
+	struct hist *h;
+	int tid;
+
+	h = kzalloc(sizeof(struct hist), GFP_KERNEL);
+	if (!h)
+		return;
+
+	for (tid = 0; tid < nr_thread; tid++)
+		hist_merge(h, ctxs[tid].cons);
+	print_hist("consumer:", "consumer", h, "per read");
+
+	kfree(h);
+}
+
+static void print_pmu(void)
+{
+	char line[192];
+	int len, i, ev;
+
+	for (i = 0; i < nr_dsa_pmu; i++) {
+		len = 0;
+		for (ev = 0; ev < PMU_NR_EVENT; ev++) {
+			if (dsa_pmu[i]->count[ev] == PMU_NA) {
+				len += scnprintf(line + len, sizeof(line) - len, "%s%s n/a",
+						ev ? ", " : "", dsa_pmu_event_name(ev));
+				continue;
+			}
+
+			len += scnprintf(line + len, sizeof(line) - len, "%s%s %llu",
+					ev ? ", " : "", dsa_pmu_event_name(ev), dsa_pmu[i]->count[ev]);
+			result("pmu%d_%s=%llu\n", dsa_pmu[i]->dev_id, dsa_pmu_event_name(ev), dsa_pmu[i]->count[ev]);
+		}
+		printk("kdsa: pmu dev %d:  %s\n", dsa_pmu[i]->dev_id, line);
+	}
+}
+
+static void print_series(void)
+{
+	struct series_summary sum;
+
+	series_summarize(io_series, &sum);
+	if (!sum.nr_row) {
+		printk("kdsa: series:     no samples after the %d ms warm-up\n", warmup_ms);
+		return;
+	}
+
+	printk("kdsa: series:     %llu x %d ms after %d ms, min %llu.%03llu, mean %llu.%03llu, max %llu.%03llu, last %llu.%03llu MIOPS\n",
+			sum.nr_row, sample_ms, warmup_ms,
+			sum.min / 1000000, sum.min / 1000 % 1000,
+			sum.mean / 1000000, sum.mean / 1000 % 1000,
+			sum.max / 1000000, sum.max / 1000 % 1000,
+			sum.last / 1000000, sum.last / 1000 % 1000);
+	result("series_rows=%llu\nseries_min_iops=%llu\nseries_mean_iops=%llu\nseries_max_iops=%llu\nseries_last_iops=%llu\n",
+			sum.nr_row, sum.min, sum.mean, sum.max, sum.last);
+}
+
+static void print_submit_stats(void)
+{
+	struct submit_stats total = {};
+	struct submit_stats *st;
+	int tid;
+
+	for (tid = 0; tid < nr_thread; tid++) {
+		st = &ctxs[tid].stats;
+		printk("kdsa: thread %2d:  submitted %llu, retries %llu, rejected %llu, retrying %llu μs\n",
+				tid, st->submitted, st->retries, st->rejected, st->retry_ns / 1000);
+
+		total.submitted += st->submitted;
+		total.retries += st->retries;
+		total.rejected += st->rejected;
+		total.retry_ns += st->retry_ns;
+	}
+
+	printk("kdsa: submit:     submitted %llu, retries %llu, rejected %llu, retrying %llu μs\n",
+			total.submitted, total.retries, total.rejected, total.retry_ns / 1000);
+	result("submitted=%llu\nretries=%llu\nrejected=%llu\nretry_ns=%llu\n",
+			total.submitted, total.retries, total.rejected, total.retry_ns);
+}
+
+static void print_recovery(void)
+{
+	u64 timeouts = 0, aborted = 0;
+	int quarantined = 0;
+	int tid;
+
+	for (tid = 0; tid < nr_thread; tid++) {
+		timeouts += ctxs[tid].timeouts;
+		aborted += ctxs[tid].aborted;
+		quarantined += ctxs[tid].nr_quar;
+	}
+
+	printk("kdsa: recovery:   timeouts %llu, aborted %llu, quarantined %d\n", timeouts, aborted, quarantined);
+	result("timeouts=%llu\naborted=%llu\nquarantined=%d\n", timeouts, aborted, quarantined);
+}
+
+/*
+ * Calibrates the dispatcher on the channels of every node with threads, as
+ * their dispatchers will see them, before any thread runs. The thresholds
+ * only last for the run, so channels, emulation or load changes between runs
+ * are picked up.
+ */
+static int test_calibrate(void)
+{
+	struct dsa_chan **chans;
+	struct dispatch *d;
+	int tid, i;
+	int rc = 0;
+
+	node_calib = kcalloc(nr_node_ids, sizeof(*node_calib), GFP_KERNEL);
+	chans = kcalloc(nr_dsa_chan, sizeof(*chans), GFP_KERNEL);
+	if (!node_calib || !chans) {
+		kfree(chans);
+		return 1;
+	}
+
+	for (tid = 0; tid < nr_thread && !rc; tid++) {
+		for (i = 0; i < tid; i++)
+			if (ctxs[i].node == ctxs[tid].node)
+				break;
+		if (i < tid)
+			continue;
+
+		d = dsa_dispatch_create(chans, node_chans(ctxs[tid].node, chans), ctxs[tid].node, NULL);
+		rc = d ? dsa_dispatch_calibrate(d) : 1;
+		if (!rc)
+			node_calib[ctxs[tid].node] = *dsa_dispatch_params(d);
+		dsa_dispatch_destroy(d);
+	}
+	kfree(chans);
+
+	return rc;
+}
+
+static int check_params(void)
+{
+	if (nr_numa < 0 || nr_chan < 0 || nr_thread < 0) {
+		printk("kdsa: invalid topology (nr_numa %d, nr_chan %d, nr_thread %d)\n", nr_numa, nr_chan, nr_thread);
+		return -EINVAL;
+	}
+
+	if (nr_desc < 0 || nr_desc > MAX_DESC || (batch && nr_desc == 1)) {
+		printk("kdsa: invalid number of descriptors %d\n", nr_desc);
+		return -EINVAL;
+	}
+
+	if (blk_size && (blk_size < MIN_BLK || blk_size > MAX_BLK)) {
+		printk("kdsa: invalid block size %d\n", blk_size);
+		return -EINVAL;
+	}
+
+	if (coalesce && !batch) {
+		printk("kdsa: coalesce needs batch mode\n");
+		return -EINVAL;
+	}
+
+	// Every thread has a single destination buffer
+	if (consume && !bulk_size && (batch || qdepth != 1)) {
+		printk("kdsa: consume needs batch=0 and qdepth=1\n");
+		return -EINVAL;
+	}
+
+	if (bulk_size < 0 || ((bulk_sg || hybrid) && !bulk_size) || (bulk_sg && hybrid)) {
+		printk("kdsa: invalid bulk size %d (bulk_sg %d, hybrid %d)\n", bulk_size, bulk_sg, hybrid);
+		return -EINVAL;
+	}
+
+	if (batch_depth < 1 || batch_depth > MAX_BATCH_DEPTH) {
+		printk("kdsa: invalid batch depth %d\n", batch_depth);
+		return -EINVAL;
+	}
+
+	if (qdepth < 0 || (nr_desc && qdepth > nr_desc)) {
+		printk("kdsa: invalid queue depth %d\n", qdepth);
+		return -EINVAL;
+	}
+
+	if (duration_ms < 1) {
+		printk("kdsa: invalid duration %d ms\n", duration_ms);
+		return -EINVAL;
+	}
+
+	if (sample_ms < 0 || warmup_ms < 0) {
+		printk("kdsa: invalid sampling (sample_ms %d, warmup_ms %d)\n", sample_ms, warmup_ms);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+// Channels for the current config, reusing those of the last run if it matches
+static int test_get_chans(void)
+{
+	int i;
+
+	if (nr_dsa_chan && chan_emulate == emulate && chan_nr_numa == nr_numa && chan_nr_chan == nr_chan)
+		return 0;
+
+	// Hardware channels are borrowed from the library
+	for (i = 0; chan_emulate && i < nr_dsa_chan; i++)
+		dsa_chan_release(dsa_chan[i]);
+	nr_dsa_chan = 0;
+	tuned_blk_size = tuned_nr_desc = 0;
+
+	if (emulate)
+		nr_dsa_chan = emulate_chans();
+	else
+		nr_dsa_chan = kdsa_get_chans(dsa_chan, MAX_CHAN, nr_numa, nr_chan);
+	if (!nr_dsa_chan) {
+		printk("kdsa: no DSA channels available\n");
+		return -ENODEV;
+	}
+	interleave_chans();
+
+	chan_emulate = emulate;
+	chan_nr_numa = nr_numa;
+	chan_nr_chan = nr_chan;
+	return 0;
+}
+
+static void test_put_chans(void)
+{
+	int i;
+
+	for (i = 0; chan_emulate && i < nr_dsa_chan; i++)
+		dsa_chan_release(dsa_chan[i]);
+	nr_dsa_chan = 0;
+}
+
+static void print_config(void);
+
+// Smallest max_xfer and max_batch of the channels
+static void chan_limits(u64 *max_xfer, u32 *max_batch)
+{
+	int i;
+
+	*max_xfer = U64_MAX;
+	*max_batch = U32_MAX;
+	for (i = 0; i < nr_dsa_chan; i++) {
+		*max_xfer = min(*max_xfer, dsa_chan[i]->max_xfer);
+		*max_batch = min(*max_batch, dsa_chan[i]->max_batch);
+	}
+}
+
+/*
+ * Fills in blk_size and nr_desc left at 0 with the knees of sweeps on thread
+ * 0's channel, which hold as long as the channels stay. The transfer size is
+ * swept only up to what every operation of the workload takes, and blk_size
+ * is then checked against them.
+ */
+static int test_tune(void)
+{
+	struct dsa_chan *c = ctxs[0].chan;
+	u64 max_xfer, max_blk;
+	u32 max_batch;
+	int rc;
+
+	chan_limits(&max_xfer, &max_batch);
+	max_blk = min_t(u64, wl_max_len(max_xfer), MAX_BLK);
+
+	if (blk_size && nr_desc)
+		return wl_check_len(blk_size, max_xfer);
+
+	if (!blk_size && bulk_size) {
+		blk_size = DEFAULT_BLK;
+	} else if (!blk_size) {
+		if (!tuned_blk_size || tuned_max_blk != max_blk) {
+			rc = tune_xfer(c, ctxs[0].node, max_blk);
+			if (rc < 0)
+				return rc;
+			tuned_blk_size = rc;
+			tuned_max_blk = max_blk;
+		}
+		blk_size = tuned_blk_size;
+	}
+
+	rc = wl_check_len(blk_size, max_xfer);
+	if (rc)
+		return rc;
+
+	// check_caps() rejects batching on channels without it
+	if (!nr_desc && (bulk_size || !batch || max_batch < 2)) {
+		nr_desc = DEFAULT_DESC;
+	} else if (!nr_desc) {
+		if (!tuned_nr_desc || tuned_len != blk_size) {
+			rc = tune_batch(c, ctxs[0].node, blk_size, min_t(u32, max_batch, MAX_DESC));
+			if (rc < 0)
+				return rc;
+			tuned_nr_desc = rc;
+			tuned_len = blk_size;
+		}
+		nr_desc = tuned_nr_desc;
+	}
+
+	printk("kdsa: tuned:      blk_size %d, nr_desc %d\n", blk_size, nr_desc);
+	return 0;
+}
+
+// Rejects what the channels would refuse, or silently drop, mid-run
+static int check_caps(void)
+{
+	struct dsa_chan *c;
+	int tid, op, i, inflight;
+
+	if (qdepth > nr_desc) {
+		printk("kdsa: invalid queue depth %d for %d descriptors\n", qdepth, nr_desc);
+		return -EINVAL;
+	}
+
+	// Bulk copies split by max_xfer and max_batch themselves
+	for (i = 0; bulk_size && i < nr_dsa_chan; i++) {
+		c = dsa_chan[i];
+		if (!chan_has_op(c, DSA_OPCODE_MEMMOVE) || (bulk_sg && !chan_has_op(c, DSA_OPCODE_BATCH))) {
+			printk("kdsa: %s cannot run bulk copies\n", c->name);
+			return -EINVAL;
+		}
+	}
+	if (bulk_size)
+		return 0;
+
+	for (tid = 0; tid < nr_thread; tid++) {
+		c = ctxs[tid].chan;
+
+		if (blk_size > c->max_xfer) {
+			printk("kdsa: %s transfers at most %llu bytes, not %d\n", c->name, c->max_xfer, blk_size);
+			return -EINVAL;
+		}
+
+		if (batch && (!chan_has_op(c, DSA_OPCODE_BATCH) || nr_desc > c->max_batch)) {
+			printk("kdsa: %s takes batches of at most %u descriptors, not %d\n", c->name, c->max_batch, nr_desc);
+			return -EINVAL;
+		}
+
+		for (op = 0; op < WL_NR_OP; op++) {
+			if (wl_enabled(op) && !chan_has_op(c, wl_opcode(op))) {
+				printk("kdsa: %s does not support %s\n", c->name, wl_name(op));
+				return -EINVAL;
+			}
+		}
+
+		// A dedicated WQ drops descriptors beyond its size
+		if (!c->dedicated)
+			continue;
+		inflight = 0;
+		for (i = 0; i < nr_thread; i++)
+			if (ctxs[i].chan == c)
+				inflight += batch ? batch_depth : qdepth ? qdepth : nr_desc;
+		if (inflight > c->wq_size) {
+			printk("kdsa: %d descriptors in flight overflow %s of %u entries\n", inflight, c->name, c->wq_size);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+// One run with the current config; the results go to the log and to results
+static int test_session(void)
+{
+	int nr_thread_cfg = nr_thread;
+	int blk_size_cfg = blk_size;
+	int nr_desc_cfg = nr_desc;
+	int tid, i;
+	int rc;
+	long long int *begin = NULL;
+	long long int *end = NULL;
+	long long int b, e;
+	long long int total_io_cnt;
+	long long int elapsed_ns;
+
+	mutex_lock(&results_lock);
+	results_len = 0;
+	mutex_unlock(&results_lock);
+
+	// The series of the last run stays readable until now
+	debugfs_remove(series_dentry);
+	series_dentry = NULL;
+	series_destroy(io_series);
+	io_series = NULL;
+
+	rc = check_params();
+	if (rc)
+		goto out;
+
+	// Channel
+	rc = test_get_chans();
+	if (rc)
+		goto out;
+
+	// Placement
+	rc = test_plan();
+	if (rc)
+		goto out;
+
+	threads = kcalloc(nr_thread, sizeof(*threads), GFP_KERNEL);
+	ctxs = kcalloc(nr_thread, sizeof(*ctxs), GFP_KERNEL);
+	begin_ktime = kcalloc(nr_thread, sizeof(*begin_ktime), GFP_KERNEL);
+	end_ktime = kcalloc(nr_thread, sizeof(*end_ktime), GFP_KERNEL);
+	begin = kcalloc(nr_thread, sizeof(*begin), GFP_KERNEL);
+	end = kcalloc(nr_thread, sizeof(*end), GFP_KERNEL);
+	if (!threads || !ctxs || !begin_ktime || !end_ktime || !begin || !end) {
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	test_place();
+
+	rc = wl_setup();
+	if (rc)
+		goto out;
+
+	rc = test_tune();
+	if (rc)
+		goto out;
+
+	rc = check_caps();
+	if (rc)
+		goto out;
+
+	if (*target) {
+		dev_target = dsa_target_open(target, nr_thread * target_window(), ctxs[0].node);
+		if (IS_ERR(dev_target)) {
+			rc = PTR_ERR(dev_target);
+			dev_target = NULL;
+			goto out;
+		}
+		printk("kdsa: target:     %s, %zu bytes per thread\n", dev_target->name, target_window());
+	}
+
+	if (pmu) {
+		rc = test_open_pmu();
+		if (rc)
+			goto out;
+	}
+
+	if (sample_ms) {
+		rc = test_init_series();
+		if (rc)
+			goto out;
+	}
+
+	if (hybrid && test_calibrate()) {
+		rc = -EIO;
+		goto out;
+	}
+
+	// Barrier
+	init_waitqueue_head(&barrier_waitqueue);
+	atomic_set(&barrier_cnt, 0);
+
+	// Create threads
+	for (tid = 0; tid < nr_thread; tid++) {
+		threads[tid] = kthread_create_on_node(test, (void *)(long)tid, ctxs[tid].node, "kdsa_thread%d", tid);
+		if (IS_ERR(threads[tid])) {
+			printk("kdsa: failed to create thread %d\n", tid);
+			threads[tid] = NULL;
+			continue;
+		}
+
+		kthread_bind(threads[tid], ctxs[tid].cpu);
+		wake_up_process(threads[tid]);
+	}
+
+	if (io_series && series_start(io_series))
+		printk("kdsa: failed to start the time series\n");
+
+	// kdsa_bench/stop or unloading ends the run early
+	wait_event_interruptible_timeout(run_waitqueue, READ_ONCE(run_stop) || kthread_should_stop(),
+			msecs_to_jiffies(duration_ms));
+
+	if (io_series)
+		series_stop(io_series);
+
+	// Stop threads
+	rc = 0;
+	for (tid = 0; tid < nr_thread; tid++) {
+		if (IS_ERR_OR_NULL(threads[tid]))
+			rc = -EINVAL;
+		else if (kthread_stop(threads[tid]))
+			rc = -ENOMEM;
+	}
+
+	// After the threads, so that the final drain is counted too
+	for (i = 0; i < nr_dsa_pmu; i++)
+		dsa_pmu_stop(dsa_pmu[i]);
+
+	// Result
+	if (!rc) {
+		for (tid = 0; tid < nr_thread; tid++) {
+			begin[tid] = ktime_to_ns(begin_ktime[tid]);
+			end[tid] = ktime_to_ns(end_ktime[tid]);
+		}
+
+		b = find_min_max(begin, nr_thread, 0);
+		e = find_min_max(end, nr_thread, 1);
+
+		total_io_cnt = 0;
+		for (tid = 0; tid < nr_thread; tid++)
+			total_io_cnt += ctxs[tid].io_cnt;
+		elapsed_ns = e - b;
+
+		printk("kdsa: ======== Result ========\n");
+		printk("kdsa: io:         %lld\n", total_io_cnt);
+		printk("kdsa: elapsed:    %lld μs\n", elapsed_ns / 1000);
+		printk("kdsa: bandwidth:  %lld.%03lld MIOPS\n",
+				(total_io_cnt * 1000) / elapsed_ns,
+				((total_io_cnt * 1000000) / elapsed_ns) % 1000);
+		result("io=%lld\nelapsed_ns=%lld\niops=%lld\nmb_s=%lld\n",
+				total_io_cnt, elapsed_ns,
+				total_io_cnt * NSEC_PER_SEC / elapsed_ns,
+				total_io_cnt * (bulk_size ? bulk_size : blk_size) * 1000 / elapsed_ns);
+		print_nodes(elapsed_ns);
+		if (bulk_size)
+			printk("kdsa: bulk:       %lld copies of %d bytes, %lld MB/s\n",
+					total_io_cnt, bulk_size, total_io_cnt * bulk_size * 1000 / elapsed_ns);
+		else
+			print_ops(elapsed_ns);
+		if (latency)
+			print_latency();
+		if (consume)
+			print_consume();
+		if (io_series)
+			print_series();
+		if (pmu)
+			print_pmu();
+		// Bulk copies submit inside the library, which counts nothing per caller
+		if (!bulk_size)
+			print_submit_stats();
+		print_recovery();
+	} else {
+		printk("kdsa: failed to test\n");
+	}
+
+out:
+	result("run=%d\nrc=%d\nstopped=%d\n", run_id, rc, READ_ONCE(run_stop));
+	print_config();
+
+	for (i = 0; i < nr_dsa_pmu; i++)
+		dsa_pmu_close(dsa_pmu[i]);
+	kfree(dsa_pmu);
+	dsa_pmu = NULL;
+	nr_dsa_pmu = 0;
+
+	for (tid = 0; ctxs && tid < nr_thread; tid++) {
+		kfree(ctxs[tid].lat);
+		kfree(ctxs[tid].cons);
+	}
+	if (!dev_target_busy)
+		dsa_target_close(dev_target);
+	dev_target = NULL;
+	dev_target_busy = false;
+	kfree(plan_cpu);
+	kfree(node_calib);
+	kfree(threads);
+	kfree(ctxs);
+	kfree(begin_ktime);
+	kfree(end_ktime);
+	kfree(begin);
+	kfree(end);
+	plan_cpu = NULL;
+	node_calib = NULL;
+	threads = NULL;
+	ctxs = NULL;
+	begin_ktime = end_ktime = NULL;
+
+	nr_thread = nr_thread_cfg;
+	blk_size = blk_size_cfg;
+	nr_desc = nr_desc_cfg;
+	return rc;
+}
+
+static int run_thread(void *data)
+{
+	int rc;
+
+	rc = test_session();
+
+	mutex_lock(&run_lock);
+	run_rc = rc;
+	running = false;
+	mutex_unlock(&run_lock);
+	wake_up_all(&run_waitqueue);
+
+	// The next run or unloading reaps the thread
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return rc;
+}
+
+static int run_start(void)
+{
+	struct task_struct *task;
+	int rc = 0;
+
+	mutex_lock(&run_lock);
+	if (running) {
+		rc = -EBUSY;
+		goto out;
+	}
+
+	if (run_task) {
+		kthread_stop(run_task);
+		run_task = NULL;
+	}
+
+	run_id++;
+	run_stop = false;
+	running = true;
+	task = kthread_run(run_thread, NULL, "kdsa_run%d", run_id);
+	if (IS_ERR(task)) {
+		running = false;
+		rc = PTR_ERR(task);
+		goto out;
+	}
+	run_task = task;
+
+out:
+	mutex_unlock(&run_lock);
+	return rc;
+}
+
+static void run_end(void)
+{
+	WRITE_ONCE(run_stop, true);
+	wake_up_all(&run_waitqueue);
+}
+
+// Control
+
+// Parameters the config file reads and writes, by module parameter name
+struct test_param {
+	const char *name;
+	int *i;
+	bool *b;
+	char *s;
+	size_t len;
+};
+
+#define PARAM_INT(p)	{ .name = #p, .i = &(p) }
+#define PARAM_BOOL(p)	{ .name = #p, .b = &(p) }
+#define PARAM_STR(p)	{ .name = #p, .s = (p), .len = sizeof(p) }
+
+static const struct test_param test_params[] = {
+	PARAM_INT(nr_numa),
+	PARAM_INT(nr_chan),
+	PARAM_INT(nr_thread),
+	PARAM_STR(workload),
+	PARAM_INT(blk_size),
+	PARAM_INT(nr_desc),
+	PARAM_BOOL(batch),
+	PARAM_INT(batch_depth),
+	PARAM_INT(qdepth),
+	PARAM_INT(bulk_size),
+	PARAM_BOOL(bulk_sg),
+	PARAM_BOOL(hybrid),
+	PARAM_BOOL(emulate),
+	PARAM_STR(target),
+	PARAM_BOOL(coalesce),
+	PARAM_BOOL(consume),
+	PARAM_BOOL(dst_cache),
+	PARAM_BOOL(pmu),
+	PARAM_BOOL(latency),
+	PARAM_INT(duration_ms),
+	PARAM_INT(sample_ms),
+	PARAM_INT(warmup_ms),
+};
+
+static int param_set(const struct test_param *p, const char *val)
+{
+	if (p->i)
+		return kstrtoint(val, 0, p->i);
+	if (p->b)
+		return kstrtobool(val, p->b);
+	return strscpy(p->s, val, p->len) < 0 ? -EINVAL : 0;
+}
+
+static void param_get(const struct test_param *p, char *buf, size_t len)
+{
+	if (p->i)
+		scnprintf(buf, len, "%d", *p->i);
+	else if (p->b)
+		scnprintf(buf, len, "%d", *p->b);
+	else
+		strscpy(buf, p->s, len);
+}
+
+// The config a run used, nr_thread as resolved, after its results
+static void print_config(void)
+{
+	const struct test_param *p;
+	char val[WL_SPEC_LEN];
+
+	for (p = test_params; p < test_params + ARRAY_SIZE(test_params); p++) {
+		param_get(p, val, sizeof(val));
+		result("%s=%s\n", p->name, val);
+	}
+}
+
+static int config_show(struct seq_file *m, void *unused)
+{
+	const struct test_param *p;
+	char val[WL_SPEC_LEN];
+
+	mutex_lock(&run_lock);
+	for (p = test_params; p < test_params + ARRAY_SIZE(test_params); p++) {
+		param_get(p, val, sizeof(val));
+		seq_printf(m, "%s=%s\n", p->name, val);
+	}
+	mutex_unlock(&run_lock);
+
+	return 0;
+}
+
+static int config_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, config_show, NULL);
+}
+
+// Whitespace-separated key=value pairs, applied in order; -EBUSY during a run
+static ssize_t config_write(struct file *file, const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	const struct test_param *p;
+	char *buf, *str, *tok, *val;
+	int rc = 0;
+
+	if (count >= PAGE_SIZE)
+		return -E2BIG;
+
+	buf = memdup_user_nul(ubuf, count);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+
+	mutex_lock(&run_lock);
+	if (running) {
+		rc = -EBUSY;
+		goto out;
+	}
+
+	str = buf;
+	while ((tok = strsep(&str, " \t\n")) != NULL) {
+		if (!*tok)
+			continue;
+
+		val = strchr(tok, '=');
+		if (!val) {
+			rc = -EINVAL;
+			goto out;
+		}
+		*val++ = '\0';
+
+		for (p = test_params; p < test_params + ARRAY_SIZE(test_params); p++)
+			if (!strcmp(p->name, tok))
+				break;
+		if (p == test_params + ARRAY_SIZE(test_params)) {
+			printk("kdsa: unknown parameter \"%s\"\n", tok);
+			rc = -EINVAL;
+			goto out;
+		}
+
+		rc = param_set(p, val);
+		if (rc) {
+			printk("kdsa: invalid %s \"%s\"\n", tok, val);
+			goto out;
+		}
+	}
+
+out:
+	mutex_unlock(&run_lock);
+	kfree(buf);
+	return rc ? rc : count;
+}
+
+static const struct file_operations config_fops = {
+	.owner		= THIS_MODULE,
+	.open		= config_open,
+	.read		= seq_read,
+	.write		= config_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+// Any write starts a run in the background
+static ssize_t start_write(struct file *file, const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	int rc;
+
+	rc = run_start();
+	return rc ? rc : count;
+}
+
+static const struct file_operations start_fops = {
+	.owner		= THIS_MODULE,
+	.write		= start_write,
+};
+
+// Any write ends the current run early; it still reports its results
+static ssize_t stop_write(struct file *file, const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	run_end();
+	return count;
+}
+
+static const struct file_operations stop_fops = {
+	.owner		= THIS_MODULE,
+	.write		= stop_write,
+};
+
+// state=running|idle, then the key=value lines of the last run
+static int results_show(struct seq_file *m, void *unused)
+{
+	seq_printf(m, "state=%s\n", READ_ONCE(running) ? "running" : "idle");
+
+	mutex_lock(&results_lock);
+	seq_write(m, results, results_len);
+	mutex_unlock(&results_lock);
+
+	return 0;
+}
+
+static int results_open(struct inode *inode, struct file *file)
+{
+	return single_open_size(file, results_show, NULL, RESULTS_SIZE + PAGE_SIZE);
+}
+
+static const struct file_operations results_fops = {
+	.owner		= THIS_MODULE,
+	.open		= results_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int __init kdsa_init(void)
+{
+	int rc;
+
+	dsa_chan = kcalloc(MAX_CHAN, sizeof(*dsa_chan), GFP_KERNEL);
+	results = kvmalloc(RESULTS_SIZE, GFP_KERNEL);
+	if (!dsa_chan || !results) {
+		rc = -ENOMEM;
+		goto failure;
+	}
+
+	debugfs_dir = debugfs_create_dir("kdsa_bench", NULL);
+	debugfs_create_file("config", 0644, debugfs_dir, NULL, &config_fops);
+	debugfs_create_file("start", 0200, debugfs_dir, NULL, &start_fops);
+	debugfs_create_file("stop", 0200, debugfs_dir, NULL, &stop_fops);
+	debugfs_create_file("results", 0444, debugfs_dir, NULL, &results_fops);
+
+	if (!autorun)
+		return 0;
+
+	// As before: the load reports the run, and fails if the run does
+	rc = run_start();
+	if (!rc) {
+		wait_event(run_waitqueue, !READ_ONCE(running));
+		rc = run_rc;
+	}
+	if (rc)
+		goto failure;
+
+	return 0;
+
+failure:
+	if (run_task)
+		kthread_stop(run_task);
+	debugfs_remove_recursive(debugfs_dir);
+	series_destroy(io_series);
+	test_put_chans();
+	kvfree(results);
+	kfree(dsa_chan);
+	return rc;
+}
+module_init(kdsa_init);
+
+static void __exit kdsa_exit(void)
+{
+	// Ends a run in progress and reaps its thread
+	if (run_task) {
+		run_end();
+		kthread_stop(run_task);
+	}
+
+	debugfs_remove_recursive(debugfs_dir);
+	series_destroy(io_series);
+	test_put_chans();
+	kvfree(results);
+	kfree(dsa_chan);
+}
+module_exit(kdsa_exit);
 
 MODULE_LICENSE("GPL");
@@ -0,0 +1,288 @@
+#include "pmu.h"
+
+#include <linux/bits.h>
+#include <linux/export.h>
+#include <linux/io.h>
+#include <linux/moduleparam.h>
+#include <linux/perf_event.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "emu.h"
+
+static char *pmu_events = "";
+module_param(pmu_events, charp, 0444);
+MODULE_PARM_DESC(pmu_events, "Override perfmon event encodings, e.g. \"ats_miss=2:0x2,eng_busy=1:0x10\"; events: descs, rd_bytes, wr_bytes, ats_miss, eng_busy, wq_occ (default empty)");
+
+struct pmu_event_info {
+	const char *name;
+	u32 cat;	// event category
+	u32 events;	// event bits within the category
+};
+
+// Defaults follow the event categories of the DSA perfmon: 0 WQ, 1 engine, 2 translation, 3 memory
+static struct pmu_event_info pmu_info[PMU_NR_EVENT] = {
+	[PMU_DESC]	= { "descs",	1, 0x0001 },
+	[PMU_RD_BYTES]	= { "rd_bytes",	3, 0x0001 },
+	[PMU_WR_BYTES]	= { "wr_bytes",	3, 0x0002 },
+	[PMU_ATS_MISS]	= { "ats_miss",	2, 0x0002 },
+	[PMU_ENG_BUSY]	= { "eng_busy",	1, 0x0010 },
+	[PMU_WQ_OCC]	= { "wq_occ",	0, 0x0001 },
+};
+
+const char *dsa_pmu_event_name(int ev)
+{
+	return pmu_info[ev].name;
+}
+EXPORT_SYMBOL_GPL(dsa_pmu_event_name);
+
+// Parses pmu_events; every entry is name=category:events
+int pmu_setup(void)
+{
+	char *spec, *cur, *tok, *val;
+	u32 cat, events;
+	int ev, rc = 0;
+
+	spec = kstrdup(pmu_events, GFP_KERNEL);
+	if (!spec)
+		return -ENOMEM;
+
+	cur = spec;
+	while ((tok = strsep(&cur, ",")) != NULL) {
+		if (!*tok)
+			continue;
+
+		val = strchr(tok, '=');
+		if (val)
+			*val++ = '\0';
+
+		for (ev = 0; ev < PMU_NR_EVENT; ev++)
+			if (!strcmp(tok, pmu_info[ev].name))
+				break;
+
+		if (ev == PMU_NR_EVENT || !val || sscanf(val, "%u:%x", &cat, &events) != 2 ||
+		    cat >= PMU_NR_CATEGORY || !events || events >= BIT(28)) {
+			printk("kdsa: invalid perfmon event \"%s\"\n", tok);
+			rc = -EINVAL;
+			break;
+		}
+
+		pmu_info[ev].cat = cat;
+		pmu_info[ev].events = events;
+	}
+
+	kfree(spec);
+	return rc;
+}
+
+int pmu_event_of(u32 cat, u32 events)
+{
+	int ev;
+
+	for (ev = 0; ev < PMU_NR_EVENT; ev++)
+		if (pmu_info[ev].cat == cat && pmu_info[ev].events == events)
+			return ev;
+
+	return -1;
+}
+
+// Capabilities of an emulated device, which supports exactly the events above
+void pmu_emu_caps(void __iomem *base, int nr_cntr)
+{
+	union idxd_perfcap cap = {};
+	u64 evntcap[PMU_NR_CATEGORY] = {};
+	int ev, cat;
+
+	for (ev = 0; ev < PMU_NR_EVENT; ev++)
+		evntcap[pmu_info[ev].cat] |= pmu_info[ev].events;
+
+	cap.num_perf_counter = nr_cntr;
+	cap.counter_width = 48;
+	cap.num_event_category = PMU_NR_CATEGORY - 1;
+	cap.writeable_counter = 1;
+	writeq(cap.bits, base + IDXD_PERFCAP_OFFSET);
+
+	for (cat = 0; cat < PMU_NR_CATEGORY; cat++)
+		writeq(evntcap[cat], base + PMU_EVNTCAP(cat));
+}
+
+static void __iomem *pmu_base(struct dsa_chan *c)
+{
+	struct idxd_device *idxd;
+
+	if (c->emu)
+		return emu_pmu_regs(c);
+
+	// Without the driver's PMU nothing arbitrates the counters
+	idxd = to_idxd_wq(c->chan)->idxd;
+	if (!idxd->perfmon_offset || !idxd->idxd_pmu)
+		return NULL;
+	return idxd->reg_base + idxd->perfmon_offset;
+}
+
+// The counters of c's device; ERR_PTR(-EOPNOTSUPP) if it has none
+struct dsa_pmu *dsa_pmu_open(struct dsa_chan *c)
+{
+	union idxd_perfcap cap;
+	struct dsa_pmu *p;
+	void __iomem *base;
+	int ev, i;
+
+	base = pmu_base(c);
+	if (!base)
+		return ERR_PTR(-EOPNOTSUPP);
+
+	cap.bits = readq(base + IDXD_PERFCAP_OFFSET);
+	if (!cap.num_perf_counter || !cap.counter_width)
+		return ERR_PTR(-EOPNOTSUPP);
+
+	p = kzalloc(sizeof(*p), GFP_KERNEL);
+	if (!p)
+		return ERR_PTR(-ENOMEM);
+
+	p->dev_id = c->dev_id;
+	p->base = base;
+	p->nr_cntr = min_t(int, cap.num_perf_counter, PMU_MAX_CNTR);
+	p->mask = cap.counter_width >= 64 ? U64_MAX : BIT_ULL(cap.counter_width) - 1;
+
+	if (!c->emu) {
+		p->pmu = &to_idxd_wq(c->chan)->idxd->idxd_pmu->pmu;
+		p->cpu = to_idxd_wq(c->chan)->idxd->idxd_pmu->cpu;
+	}
+	for (ev = 0; ev < PMU_NR_EVENT; ev++)
+		p->count[ev] = PMU_NA;
+	// A run that never started its threads stops counters it never started
+	for (i = 0; i < PMU_MAX_CNTR; i++)
+		p->ev[i] = -1;
+
+	return p;
+}
+EXPORT_SYMBOL_GPL(dsa_pmu_open);
+
+static void pmu_release(struct dsa_pmu *p)
+{
+	int ev;
+
+	for (ev = 0; ev < PMU_NR_EVENT; ev++) {
+		if (p->event[ev])
+			perf_event_release_kernel(p->event[ev]);
+		p->event[ev] = NULL;
+	}
+}
+
+void dsa_pmu_close(struct dsa_pmu *p)
+{
+	pmu_release(p);
+	kfree(p);
+}
+EXPORT_SYMBOL_GPL(dsa_pmu_close);
+
+static bool pmu_supported(struct dsa_pmu *p, int ev)
+{
+	u64 evntcap = readq(p->base + PMU_EVNTCAP(pmu_info[ev].cat));
+
+	return (evntcap & pmu_info[ev].events) == pmu_info[ev].events;
+}
+
+/*
+ * One kernel counter per event on the idxd PMU, encoded as its format
+ * attributes say: the category in config:0-3, the events in config:4-31.
+ * The driver assigns the hardware counters, so perf sessions on the same
+ * device keep theirs and an event gets none once they are all taken.
+ */
+static void pmu_start_perf(struct dsa_pmu *p)
+{
+	struct perf_event_attr attr;
+	struct perf_event *event;
+	int ev;
+
+	for (ev = 0; ev < PMU_NR_EVENT; ev++) {
+		if (!pmu_supported(p, ev))
+			continue;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.type = p->pmu->type;
+		attr.size = sizeof(attr);
+		attr.config = pmu_info[ev].cat | (u64)pmu_info[ev].events << 4;
+
+		event = perf_event_create_kernel_counter(&attr, p->cpu, NULL, NULL, NULL);
+		if (IS_ERR(event)) {
+			printk("kdsa: pmu dev %d: cannot count %s (rc %ld)\n", p->dev_id, pmu_info[ev].name, PTR_ERR(event));
+			continue;
+		}
+		p->event[ev] = event;
+	}
+}
+
+static void pmu_stop_perf(struct dsa_pmu *p)
+{
+	u64 enabled, running;
+	int ev;
+
+	for (ev = 0; ev < PMU_NR_EVENT; ev++)
+		if (p->event[ev])
+			p->count[ev] = perf_event_read_value(p->event[ev], &enabled, &running);
+	pmu_release(p);
+}
+
+/*
+ * Starts counting every event the device advertises in EVNTCAP, as far as
+ * the counters go. On an emulated device, one counter is programmed per
+ * event and its starting value recorded; counters are not reset, so
+ * dsa_pmu_stop() reports the difference.
+ */
+void dsa_pmu_start(struct dsa_pmu *p)
+{
+	union idxd_cntrcfg cfg;
+	int ev, i;
+
+	if (p->pmu) {
+		pmu_start_perf(p);
+		return;
+	}
+
+	for (i = 0; i < p->nr_cntr; i++) {
+		p->ev[i] = -1;
+		writeq(0, p->base + PMU_CNTRCFG(i));
+	}
+
+	for (ev = 0, i = 0; ev < PMU_NR_EVENT && i < p->nr_cntr; ev++) {
+		if (!pmu_supported(p, ev))
+			continue;
+
+		p->ev[i] = ev;
+		p->start[i] = readq(p->base + PMU_CNTRDATA(i));
+
+		cfg.val = 0;
+		cfg.enable = 1;
+		cfg.event_category = pmu_info[ev].cat;
+		cfg.events = pmu_info[ev].events;
+		writeq(cfg.val, p->base + PMU_CNTRCFG(i));
+		i++;
+	}
+}
+EXPORT_SYMBOL_GPL(dsa_pmu_start);
+
+void dsa_pmu_stop(struct dsa_pmu *p)
+{
+	u64 end;
+	int ev, i;
+
+	for (ev = 0; ev < PMU_NR_EVENT; ev++)
+		p->count[ev] = PMU_NA;
+
+	if (p->pmu) {
+		pmu_stop_perf(p);
+		return;
+	}
+
+	for (i = 0; i < p->nr_cntr; i++) {
+		if (p->ev[i] < 0)
+			continue;
+
+		end = readq(p->base + PMU_CNTRDATA(i));
+		writeq(0, p->base + PMU_CNTRCFG(i));
+		p->count[p->ev[i]] = (end - p->start[i]) & p->mask;
+	}
+}
+EXPORT_SYMBOL_GPL(dsa_pmu_stop);
@@ -0,0 +1,62 @@
+#ifndef _PMU_H_
+#define _PMU_H_
+
+#include "driver.h"
+
+// Device counters sampled over a run; the encodings live in pmu.c
+enum pmu_event {
+	PMU_DESC = 0,	// descriptors completed
+	PMU_RD_BYTES,
+	PMU_WR_BYTES,
+	PMU_ATS_MISS,	// address translations that missed the ATC
+	PMU_ENG_BUSY,
+	PMU_WQ_OCC,	// WQ occupancy
+	PMU_NR_EVENT,
+};
+
+#define PMU_MAX_CNTR	(32)
+#define PMU_NR_CATEGORY	(16)
+#define PMU_NA		(U64_MAX)	// event not counted
+
+// Register offsets within the perfmon table, as in the idxd driver
+#define PMU_CNTRCFG(i)		(IDXD_CNTRCFG_OFFSET + (i) * sizeof(u64))
+#define PMU_CNTRDATA(i)		(IDXD_CNTRDATA_OFFSET + (i) * sizeof(u64))
+#define PMU_EVNTCAP(cat)	(IDXD_EVNTCAP_OFFSET + (cat) * sizeof(u64))
+
+/*
+ * Perfmon of one device. An idxd device is counted through the perf PMU its
+ * driver registers, which owns the counters; base then only serves to read
+ * the capabilities. An emulated device has a page of registers of its own,
+ * which is programmed directly.
+ */
+struct dsa_pmu {
+	int dev_id;
+	void __iomem *base;
+
+	// idxd device
+	struct pmu *pmu;
+	int cpu;			// the PMU counts system-wide on this CPU
+	struct perf_event *event[PMU_NR_EVENT];
+
+	// Emulated device
+	int nr_cntr;
+	u64 mask;			// counter width
+	int ev[PMU_MAX_CNTR];		// event on each counter, -1 if unused
+	u64 start[PMU_MAX_CNTR];
+
+	u64 count[PMU_NR_EVENT];	// after dsa_pmu_stop(), PMU_NA if not counted
+};
+
+int pmu_setup(void);
+const char *dsa_pmu_event_name(int ev);
+
+struct dsa_pmu *dsa_pmu_open(struct dsa_chan *c);
+void dsa_pmu_close(struct dsa_pmu *p);
+void dsa_pmu_start(struct dsa_pmu *p);
+void dsa_pmu_stop(struct dsa_pmu *p);
+
+// For the emulator
+int pmu_event_of(u32 cat, u32 events);
+void pmu_emu_caps(void __iomem *base, int nr_cntr);
+
+#endif
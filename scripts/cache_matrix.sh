@@ -0,0 +1,35 @@
+#!/bin/bash
+
+# Runs the benchmark with and without cache control on the destination and
+# prints its throughput and the consumer read latency for every block size.
+
+set -u
+
+blk_sizes="4096 65536 1048576"
+extra_args="$*"
+ctl=/sys/kernel/debug/kdsa_bench
+
+cd "$(dirname "$0")/.."
+
+if ! lsmod | grep -q "^kdsa "; then
+	sudo insmod kdsa.ko || exit 1
+fi
+
+# One load for every run; each run is configured and started through debugfs
+if ! lsmod | grep -q "^kdsa_bench "; then
+	sudo insmod kdsa_bench.ko autorun=0 || exit 1
+fi
+
+for blk_size in $blk_sizes; do
+	for dst_cache in 0 1; do
+		echo "blk_size=$blk_size dst_cache=$dst_cache"
+		echo "workload=memmove blk_size=$blk_size dst_cache=$dst_cache consume=1 batch=0 qdepth=1 latency=1 $extra_args" | \
+			sudo tee $ctl/config > /dev/null || continue
+		echo 1 | sudo tee $ctl/start > /dev/null || continue
+		while sudo grep -q "^state=running" $ctl/results; do
+			sleep 0.5
+		done
+		sudo grep -E "^(rc|iops|mb_s|memmove_io|latency_p50_ns|latency_p99_ns|consumer_p50_ns|consumer_p99_ns)=" \
+			$ctl/results | sed 's/^/    /'
+	done
+done
@@ -0,0 +1,207 @@
+#include "series.h"
+
+#include <linux/kthread.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+
+static inline u64 *series_row(struct series *s, u64 idx)
+{
+	return s->ring + (idx % s->size) * (s->nr_col + 1);
+}
+
+static void series_sample(struct series *s)
+{
+	u64 *row;
+
+	spin_lock(&s->lock);
+	row = series_row(s, s->nr);
+	row[0] = ktime_get_ns() - s->start_ns;
+	s->read(row + 1, s->arg);
+	s->nr++;
+	spin_unlock(&s->lock);
+}
+
+static int series_thread(void *data)
+{
+	struct series *s = data;
+
+	while (!kthread_should_stop()) {
+		// kthread_stop() cuts the last interval short
+		schedule_timeout_interruptible(msecs_to_jiffies(s->interval_ms));
+		series_sample(s);
+	}
+
+	return 0;
+}
+
+struct series *series_create(int nr_col, int size, u64 unit, unsigned int interval_ms, unsigned int warmup_ms,
+		void (*read)(u64 *col, void *arg), void *arg)
+{
+	struct series *s;
+
+	s = kzalloc(sizeof(*s), GFP_KERNEL);
+	if (!s)
+		return NULL;
+
+	// A row needs the sample before it
+	s->size = clamp(size, 2, SERIES_MAX_SAMPLE);
+	s->ring = kvcalloc((size_t)s->size * (nr_col + 1), sizeof(u64), GFP_KERNEL);
+	if (!s->ring) {
+		kfree(s);
+		return NULL;
+	}
+
+	s->nr_col = nr_col;
+	s->unit = unit;
+	s->interval_ms = interval_ms;
+	s->warmup_ns = (u64)warmup_ms * NSEC_PER_MSEC;
+	s->read = read;
+	s->arg = arg;
+	spin_lock_init(&s->lock);
+
+	return s;
+}
+
+void series_destroy(struct series *s)
+{
+	if (!s)
+		return;
+
+	series_stop(s);
+	kvfree(s->ring);
+	kfree(s);
+}
+
+// Takes the first sample now, at time 0
+int series_start(struct series *s)
+{
+	struct task_struct *task;
+
+	s->nr = 0;
+	s->start_ns = ktime_get_ns();
+	series_sample(s);
+
+	task = kthread_run(series_thread, s, "kdsa_series");
+	if (IS_ERR(task))
+		return PTR_ERR(task);
+
+	s->task = task;
+	return 0;
+}
+
+// Takes the last sample when the series stops
+void series_stop(struct series *s)
+{
+	if (!s->task)
+		return;
+
+	kthread_stop(s->task);
+	s->task = NULL;
+}
+
+// Oldest sample a row can start from
+static inline u64 series_first(struct series *s)
+{
+	return s->nr > s->size ? s->nr - s->size : 0;
+}
+
+static inline u64 series_rate(u64 cnt, u64 dt)
+{
+	return dt ? div64_u64(cnt * NSEC_PER_SEC, dt) : 0;
+}
+
+static u64 series_sum(struct series *s, const u64 *prev, const u64 *row)
+{
+	u64 sum = 0;
+	int i;
+
+	for (i = 1; i <= s->nr_col; i++)
+		sum += row[i] - prev[i];
+	return sum;
+}
+
+void series_summarize(struct series *s, struct series_summary *sum)
+{
+	u64 *prev, *row;
+	u64 idx, rate, total = 0, total_ns = 0;
+
+	memset(sum, 0, sizeof(*sum));
+	sum->min = U64_MAX;
+
+	spin_lock(&s->lock);
+	for (idx = series_first(s) + 1; idx < s->nr; idx++) {
+		prev = series_row(s, idx - 1);
+		row = series_row(s, idx);
+		if (row[0] <= s->warmup_ns)
+			continue;
+
+		rate = series_rate(series_sum(s, prev, row), row[0] - prev[0]);
+		sum->min = min(sum->min, rate);
+		sum->max = max(sum->max, rate);
+		sum->last = rate;
+		sum->nr_row++;
+
+		total += series_sum(s, prev, row);
+		total_ns += row[0] - prev[0];
+	}
+	spin_unlock(&s->lock);
+
+	if (!sum->nr_row)
+		sum->min = 0;
+	sum->mean = series_rate(total, total_ns);
+}
+
+/*
+ * One CSV row per interval: its end in ms, completions, bytes and the
+ * resulting rates, whether it is part of the warm-up, then the completions
+ * of every thread.
+ */
+static int series_show(struct seq_file *m, void *unused)
+{
+	struct series *s = m->private;
+	u64 *prev, *row;
+	u64 idx, io, rate, dt;
+	int i;
+
+	seq_puts(m, "t_ms,io,bytes,miops,mb_s,warmup");
+	for (i = 0; i < s->nr_col; i++)
+		seq_printf(m, ",thread%d", i);
+	seq_putc(m, '\n');
+
+	spin_lock(&s->lock);
+	for (idx = series_first(s) + 1; idx < s->nr; idx++) {
+		prev = series_row(s, idx - 1);
+		row = series_row(s, idx);
+		dt = row[0] - prev[0];
+		io = series_sum(s, prev, row);
+		rate = series_rate(io, dt);
+
+		seq_printf(m, "%llu,%llu,%llu,%llu.%03llu,%llu,%d",
+				div_u64(row[0], NSEC_PER_MSEC), io, io * s->unit,
+				div_u64(rate, 1000000), div_u64(rate, 1000) % 1000,
+				div_u64(series_rate(io * s->unit, dt), 1000000),
+				row[0] <= s->warmup_ns);
+		for (i = 1; i <= s->nr_col; i++)
+			seq_printf(m, ",%llu", row[i] - prev[i]);
+		seq_putc(m, '\n');
+	}
+	spin_unlock(&s->lock);
+
+	return 0;
+}
+
+static int series_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, series_show, inode->i_private);
+}
+
+const struct file_operations series_fops = {
+	.owner		= THIS_MODULE,
+	.open		= series_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
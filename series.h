@@ -0,0 +1,51 @@
+#ifndef _SERIES_H_
+#define _SERIES_H_
+
+#include <linux/fs.h>
+#include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+#define SERIES_MAX_SAMPLE	(4096)
+
+/*
+ * Time series of per-thread counters. A kthread samples them every interval
+ * into a ring that keeps the latest size samples; each row then reports the
+ * change since the previous one. Rows that end before warmup are still shown
+ * but left out of the summary.
+ */
+struct series {
+	int nr_col;			// one counter per thread
+	int size;			// ring capacity, in samples
+	u64 unit;			// bytes per count
+	unsigned int interval_ms;
+	u64 warmup_ns;
+	void (*read)(u64 *col, void *arg);
+	void *arg;
+
+	struct task_struct *task;
+	spinlock_t lock;
+	u64 start_ns;
+	u64 nr;				// samples taken; the ring holds the last size
+	u64 *ring;			// per sample: time since start, then nr_col counts
+};
+
+// Steady-state rates, in counts per second, over the rows after warmup
+struct series_summary {
+	u64 nr_row;
+	u64 min, mean, max, last;
+};
+
+struct series *series_create(int nr_col, int size, u64 unit, unsigned int interval_ms, unsigned int warmup_ms,
+		void (*read)(u64 *col, void *arg), void *arg);
+void series_destroy(struct series *s);
+
+int series_start(struct series *s);
+void series_stop(struct series *s);
+
+void series_summarize(struct series *s, struct series_summary *sum);
+
+// debugfs file_operations printing the rows; i_private is the series
+extern const struct file_operations series_fops;
+
+#endif
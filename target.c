@@ -0,0 +1,123 @@
+#include "target.h"
+
+#include <linux/export.h>
+#include <linux/ioport.h>
+#include <linux/pci.h>
+#include <linux/slab.h>
+
+#define TARGET_LOCAL	"local"
+
+static int target_open_local(struct dsa_target *t, int node)
+{
+	t->mem = alloc_pages_exact_nid(node, t->size, GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN);
+	if (!t->mem) {
+		printk("kdsa: failed to allocate %zu bytes for the stand-in target\n", t->size);
+		return -ENOMEM;
+	}
+
+	strscpy(t->name, TARGET_LOCAL, sizeof(t->name));
+	return 0;
+}
+
+// The first device with the given IDs; the window starts at the beginning of the BAR
+static int target_open_pci(struct dsa_target *t, unsigned int vendor, unsigned int device, int bar)
+{
+	if (bar < 0 || bar >= PCI_STD_NUM_BARS) {
+		printk("kdsa: invalid BAR %d\n", bar);
+		return -EINVAL;
+	}
+
+	t->pdev = pci_get_device(vendor, device, NULL);
+	if (!t->pdev) {
+		printk("kdsa: no PCI device %04x:%04x\n", vendor, device);
+		return -ENODEV;
+	}
+	t->bar = bar;
+	snprintf(t->name, sizeof(t->name), "%s/bar%d", pci_name(t->pdev), bar);
+
+	if (!(pci_resource_flags(t->pdev, bar) & IORESOURCE_MEM) || !pci_resource_start(t->pdev, bar)) {
+		printk("kdsa: %s is not an assigned memory BAR\n", t->name);
+		goto failure;
+	}
+	if (pci_resource_len(t->pdev, bar) < t->size) {
+		printk("kdsa: %s has %llu bytes, %zu needed\n",
+				t->name, (u64)pci_resource_len(t->pdev, bar), t->size);
+		goto failure;
+	}
+
+	t->phys = pci_resource_start(t->pdev, bar);
+	return 0;
+
+failure:
+	pci_dev_put(t->pdev);
+	t->pdev = NULL;
+	return -EINVAL;
+}
+
+/*
+ * Opens the target named by spec, either "local" for pages on node or
+ * "vendor:device[:bar]" in hex for a PCI BAR (BAR 1 by default), and checks
+ * that it can hold size bytes.
+ */
+struct dsa_target *dsa_target_open(const char *spec, size_t size, int node)
+{
+	unsigned int vendor, device;
+	struct dsa_target *t;
+	int bar = 1;
+	int rc;
+
+	t = kzalloc(sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return ERR_PTR(-ENOMEM);
+	t->size = size;
+
+	if (!strcmp(spec, TARGET_LOCAL)) {
+		rc = target_open_local(t, node);
+	} else if (sscanf(spec, "%x:%x:%d", &vendor, &device, &bar) >= 2) {
+		rc = target_open_pci(t, vendor, device, bar);
+	} else {
+		printk("kdsa: invalid target \"%s\"\n", spec);
+		rc = -EINVAL;
+	}
+
+	if (rc) {
+		kfree(t);
+		return ERR_PTR(rc);
+	}
+
+	return t;
+}
+EXPORT_SYMBOL_GPL(dsa_target_open);
+
+void dsa_target_close(struct dsa_target *t)
+{
+	if (IS_ERR_OR_NULL(t))
+		return;
+
+	if (t->mem)
+		free_pages_exact(t->mem, t->size);
+	pci_dev_put(t->pdev);
+	kfree(t);
+}
+EXPORT_SYMBOL_GPL(dsa_target_close);
+
+// Maps len bytes at off for c; DMA_MAPPING_ERROR if out of range or unreachable
+dma_addr_t dsa_target_map(struct dsa_target *t, struct dsa_chan *c, size_t off, size_t len)
+{
+	if (off > t->size || len > t->size - off)
+		return DMA_MAPPING_ERROR;
+
+	if (t->mem)
+		return chan_map(c, t->mem + off, len);
+	return chan_map_resource(c, t->phys + off, len);
+}
+EXPORT_SYMBOL_GPL(dsa_target_map);
+
+void dsa_target_unmap(struct dsa_target *t, struct dsa_chan *c, dma_addr_t addr, size_t len)
+{
+	if (t->mem)
+		chan_unmap(c, addr, len);
+	else
+		chan_unmap_resource(c, addr, len);
+}
+EXPORT_SYMBOL_GPL(dsa_target_unmap);
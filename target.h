@@ -0,0 +1,30 @@
+#ifndef _TARGET_H_
+#define _TARGET_H_
+
+#include "driver.h"
+
+/*
+ * Device memory a channel can copy into: a window of a PCI BAR for
+ * peer-to-peer transfers, or ordinary pages standing in for one on hosts
+ * without such a device.
+ */
+struct dsa_target {
+	char name[32];
+	size_t size;
+
+	// PCI BAR
+	struct pci_dev *pdev;
+	int bar;
+	phys_addr_t phys;
+
+	// Stand-in
+	void *mem;
+};
+
+struct dsa_target *dsa_target_open(const char *spec, size_t size, int node);
+void dsa_target_close(struct dsa_target *t);
+
+dma_addr_t dsa_target_map(struct dsa_target *t, struct dsa_chan *c, size_t off, size_t len);
+void dsa_target_unmap(struct dsa_target *t, struct dsa_chan *c, dma_addr_t addr, size_t len);
+
+#endif
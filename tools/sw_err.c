@@ -1,8 +1,27 @@
+/*
+ * Decodes the DSA software error register and event log.
+ *
+ *   sw_err [file]              decode a dump of kdsa/errors in debugfs
+ *                              (default /sys/kernel/debug/kdsa/errors, - for stdin)
+ *   sw_err -x w0 [w1 [w2 [w3]]]  decode one SWERR value given as hex words
+ *
+ * Build with: cc -O2 -o sw_err tools/sw_err.c
+ */
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
 typedef uint64_t u64;
 
+#define DUMP_PATH   "/sys/kernel/debug/kdsa/errors"
+#define MAX_DEV     64
+#define MAX_WQ      256
+#define EVL_WORDS   8   // DSA event log entries are 64 bytes
+
 struct sw_err_reg {
     union {
         struct {
@@ -33,42 +52,280 @@ struct sw_err_reg {
     };
 } __attribute__((packed));
 
+// Event log entry of a DSA device: the error, then the completion record
+struct evl_entry {
+    union {
+        struct {
+            u64 rsvd:2;
+            u64 desc_valid:1;
+            u64 wq_idx_valid:1;
+            u64 batch:1;
+            u64 fault_rw:1;
+            u64 priv:1;
+            u64 err_info_valid:1;
+            u64 error:8;
+            u64 wq_idx:8;
+            u64 batch_id:8;
+            u64 operation:8;
+            u64 pasid:20;
+            u64 rsvd2:4;
+
+            u64 batch_idx:16;
+            u64 rsvd3:16;
+            u64 invalid_flags:32;   // int_handle and operand_id on other errors
+
+            u64 fault_addr;
+
+            u64 rsvd5;
+
+            // Completion record
+            u8 cr_status;
+            u8 cr_result;
+            u16 cr_rsvd;
+            u32 cr_bytes_completed;
+            u64 cr_fault_addr;
+            u64 cr_rsvd2[2];
+        };
+        u64 bits[EVL_WORDS];
+    };
+} __attribute__((packed));
+
+static const char *error_names[256] = {
+    [0x00] = "none",
+    [0x01] = "success",
+    [0x02] = "success with false predicate",
+    [0x03] = "page fault (no block on fault)",
+    [0x04] = "page fault (completion record)",
+    [0x05] = "batch failure",
+    [0x06] = "page fault reading descriptor list",
+    [0x07] = "delta offsets not increasing",
+    [0x08] = "delta offset out of range",
+    [0x09] = "DIF error",
+    [0x10] = "unsupported opcode",
+    [0x11] = "invalid flags",
+    [0x12] = "non-zero reserved field",
+    [0x13] = "transfer size out of range",
+    [0x14] = "descriptor count out of range",
+    [0x15] = "delta record size out of range",
+    [0x16] = "overlapping buffers",
+    [0x17] = "dualcast address bits differ",
+    [0x18] = "misaligned descriptor list",
+    [0x19] = "invalid interrupt handle",
+    [0x1a] = "page fault on completion record",
+    [0x1b] = "misaligned completion record",
+    [0x1c] = "misaligned address",
+    [0x1d] = "privileged request in user mode",
+    [0x1e] = "traffic class misconfigured",
+    [0x1f] = "page fault reading batch descriptor",
+    [0x20] = "hardware error",
+    [0x21] = "hardware error on descriptor read",
+    [0x22] = "address translation failure",
+    [0x26] = "page fault before drain",
+    [0x27] = "page fault in batch",
+};
+
+static const char *op_names[256] = {
+    [0x00] = "noop",
+    [0x01] = "batch",
+    [0x02] = "drain",
+    [0x03] = "memmove",
+    [0x04] = "memfill",
+    [0x05] = "compare",
+    [0x06] = "compval",
+    [0x07] = "cr_delta",
+    [0x08] = "ap_delta",
+    [0x09] = "dualcast",
+    [0x10] = "crcgen",
+    [0x11] = "copy_crc",
+    [0x12] = "dif_check",
+    [0x13] = "dif_ins",
+    [0x14] = "dif_strp",
+    [0x15] = "dif_updt",
+    [0x20] = "cflush",
+};
+
+static const char *error_name(unsigned int code)
+{
+    return error_names[code & 0xff] ? error_names[code & 0xff] : "unknown";
+}
+
+static const char *op_name(unsigned int op)
+{
+    return op_names[op & 0xff] ? op_names[op & 0xff] : "unknown";
+}
+
+// Counts per error code and per WQ over the whole dump
+static unsigned long error_cnt[256];
+static unsigned long wq_cnt[MAX_DEV][MAX_WQ];
+static unsigned long nr_record;
+
+static void account(int dev, unsigned int error, int wq_valid, unsigned int wq)
+{
+    error_cnt[error & 0xff]++;
+    if (wq_valid && dev >= 0 && dev < MAX_DEV && wq < MAX_WQ)
+        wq_cnt[dev][wq]++;
+    nr_record++;
+}
+
 void print_sw_err_reg(struct sw_err_reg *reg) {
-    printf("bits[0] = 0x%016llx\n", reg->bits[0]);
-    printf("  valid        = %llu\n", reg->valid);
-    printf("  overflow     = %llu\n", reg->overflow);
-    printf("  desc_valid   = %llu\n", reg->desc_valid);
-    printf("  wq_idx_valid = %llu\n", reg->wq_idx_valid);
-    printf("  batch        = %llu\n", reg->batch);
-    printf("  fault_rw     = %llu\n", reg->fault_rw);
-    printf("  priv         = %llu\n", reg->priv);
-    printf("  rsvd         = %llu\n", reg->rsvd);
-    printf("  error        = 0x%02llx\n", reg->error);
-    printf("  wq_idx       = 0x%02llx\n", reg->wq_idx);
-    printf("  rsvd2        = 0x%02llx\n", reg->rsvd2);
-    printf("  operation    = 0x%02llx\n", reg->operation);
-    printf("  pasid        = 0x%05llx\n", reg->pasid);
-    printf("  rsvd3        = 0x%01llx\n", reg->rsvd3);
-
-    printf("bits[1] = 0x%016llx\n", reg->bits[1]);
-    printf("  batch_idx    = 0x%04llx\n", reg->batch_idx);
-    printf("  rsvd4        = 0x%04llx\n", reg->rsvd4);
-    printf("  invalid_flags= 0x%08llx\n", reg->invalid_flags);
-
-    printf("bits[2] = 0x%016llx\n", reg->bits[2]);
-    printf("  fault_addr   = 0x%016llx\n", reg->fault_addr);
-
-    printf("bits[3] = 0x%016llx\n", reg->bits[3]);
-    printf("  rsvd5        = 0x%016llx\n", reg->rsvd5);
+    printf("bits[0] = 0x%016llx\n", (unsigned long long)reg->bits[0]);
+    printf("  valid        = %u\n", (unsigned)reg->valid);
+    printf("  overflow     = %u\n", (unsigned)reg->overflow);
+    printf("  desc_valid   = %u\n", (unsigned)reg->desc_valid);
+    printf("  wq_idx_valid = %u\n", (unsigned)reg->wq_idx_valid);
+    printf("  batch        = %u\n", (unsigned)reg->batch);
+    printf("  fault_rw     = %u (%s)\n", (unsigned)reg->fault_rw, reg->fault_rw ? "write" : "read");
+    printf("  priv         = %u\n", (unsigned)reg->priv);
+    printf("  error        = 0x%02x (%s)\n", (unsigned)reg->error, error_name(reg->error));
+    printf("  wq_idx       = %u\n", (unsigned)reg->wq_idx);
+    printf("  operation    = 0x%02x (%s)\n", (unsigned)reg->operation, op_name(reg->operation));
+    printf("  pasid        = 0x%05x\n", (unsigned)reg->pasid);
+
+    printf("bits[1] = 0x%016llx\n", (unsigned long long)reg->bits[1]);
+    printf("  batch_idx    = %u\n", (unsigned)reg->batch_idx);
+    printf("  invalid_flags= 0x%08x\n", (unsigned)reg->invalid_flags);
+
+    printf("bits[2] = 0x%016llx\n", (unsigned long long)reg->bits[2]);
+    printf("  fault_addr   = 0x%016llx\n", (unsigned long long)reg->fault_addr);
+
+    printf("bits[3] = 0x%016llx\n", (unsigned long long)reg->bits[3]);
+}
+
+void print_evl_entry(struct evl_entry *e) {
+    printf("  error        = 0x%02x (%s)\n", (unsigned)e->error, error_name(e->error));
+    printf("  operation    = 0x%02x (%s)\n", (unsigned)e->operation, op_name(e->operation));
+    printf("  desc_valid   = %u, wq_idx_valid = %u, err_info_valid = %u\n",
+            (unsigned)e->desc_valid, (unsigned)e->wq_idx_valid, (unsigned)e->err_info_valid);
+    printf("  wq_idx       = %u\n", (unsigned)e->wq_idx);
+    printf("  batch        = %u, batch_id = %u, batch_idx = %u\n",
+            (unsigned)e->batch, (unsigned)e->batch_id, (unsigned)e->batch_idx);
+    printf("  fault_rw     = %u (%s), priv = %u\n",
+            (unsigned)e->fault_rw, e->fault_rw ? "write" : "read", (unsigned)e->priv);
+    printf("  pasid        = 0x%05x\n", (unsigned)e->pasid);
+    if (e->error == 0x11)
+        printf("  invalid_flags= 0x%08x\n", (unsigned)e->invalid_flags);
+    else
+        printf("  int_handle   = 0x%04x, operand_id = %u\n",
+                (unsigned)(e->invalid_flags & 0xffff), (unsigned)(e->invalid_flags >> 29));
+    printf("  fault_addr   = 0x%016llx\n", (unsigned long long)e->fault_addr);
+    printf("  completion   = status 0x%02x (%s), result %u, bytes_completed %u, fault_addr 0x%016llx\n",
+            (unsigned)e->cr_status, error_name(e->cr_status & 0x3f), (unsigned)e->cr_result,
+            (unsigned)e->cr_bytes_completed, (unsigned long long)e->cr_fault_addr);
+}
+
+static int parse_words(char *str, u64 *words, int max)
+{
+    char *tok, *end;
+    int n = 0;
+
+    while (n < max && (tok = strtok(str, " \t\n")) != NULL) {
+        str = NULL;
+        words[n++] = strtoull(tok, &end, 16);
+        if (*end)
+            return -1;
+    }
+    return n;
 }
 
-int main() {
+static void decode_line(char *line)
+{
+    struct sw_err_reg reg;
+    struct evl_entry e;
+    u64 words[EVL_WORDS] = {0};
+    char which[8];
+    unsigned int slot;
+    int dev, pending, off;
+
+    if (sscanf(line, "swerr %d %7s %n", &dev, which, &off) == 2) {
+        if (parse_words(line + off, words, 4) < 1)
+            goto invalid;
+        memcpy(reg.bits, words, sizeof(reg.bits));
+        if (!reg.valid)
+            return;
+
+        printf("dev %d: SWERR (%s)\n", dev, which);
+        print_sw_err_reg(&reg);
+        // The driver's copy repeats the live register until the next error
+        if (!strcmp(which, "last"))
+            account(dev, reg.error, reg.wq_idx_valid, reg.wq_idx);
+        return;
+    }
+
+    if (sscanf(line, "evl %d %u %d %n", &dev, &slot, &pending, &off) == 3) {
+        if (parse_words(line + off, words, EVL_WORDS) < 4)
+            goto invalid;
+        memcpy(e.bits, words, sizeof(e.bits));
+
+        printf("dev %d: event log slot %u%s\n", dev, slot, pending ? " (pending)" : "");
+        print_evl_entry(&e);
+        account(dev, e.error, e.wq_idx_valid, e.wq_idx);
+        return;
+    }
+
+    if (!strncmp(line, "dev ", 4)) {
+        printf("%s", line);
+        return;
+    }
+
+invalid:
+    fprintf(stderr, "sw_err: cannot parse: %s", line);
+}
+
+static void print_summary(void)
+{
+    int code, dev, wq;
+
+    printf("\n%lu errors\n", nr_record);
+    for (code = 0; code < 256; code++)
+        if (error_cnt[code])
+            printf("  error 0x%02x %-40s %lu\n", code, error_name(code), error_cnt[code]);
+
+    for (dev = 0; dev < MAX_DEV; dev++)
+        for (wq = 0; wq < MAX_WQ; wq++)
+            if (wq_cnt[dev][wq])
+                printf("  dev %d wq %-3d %lu\n", dev, wq, wq_cnt[dev][wq]);
+}
+
+static int decode_value(int argc, char **argv)
+{
     struct sw_err_reg reg = {0};
-    reg.bits[0] = 0x0000010300011a2fULL;
-    reg.bits[1] = 0x0000000000000000ULL;
-    reg.bits[2] = 0x00000000ffea2000ULL;
-    reg.bits[3] = 0x0000000000000000ULL;
+    int i;
+
+    for (i = 0; i < argc && i < 4; i++)
+        reg.bits[i] = strtoull(argv[i], NULL, 16);
 
     print_sw_err_reg(&reg);
     return 0;
 }
+
+int main(int argc, char **argv) {
+    const char *path = DUMP_PATH;
+    char line[1024];
+    FILE *f;
+
+    if (argc > 1 && !strcmp(argv[1], "-x")) {
+        if (argc < 3) {
+            fprintf(stderr, "usage: %s -x w0 [w1 [w2 [w3]]]\n", argv[0]);
+            return 1;
+        }
+        return decode_value(argc - 2, argv + 2);
+    }
+
+    if (argc > 1)
+        path = argv[1];
+
+    f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+
+    while (fgets(line, sizeof(line), f))
+        decode_line(line);
+
+    if (f != stdin)
+        fclose(f);
+
+    print_summary();
+    return 0;
+}
@@ -0,0 +1,70 @@
+#include "topo.h"
+
+#include <linux/cpumask.h>
+#include <linux/slab.h>
+#include <linux/topology.h>
+
+// Whether cpu is an SMT sibling rather than the first thread of its core
+bool topo_smt(int cpu)
+{
+	return cpumask_first(topology_sibling_cpumask(cpu)) != cpu;
+}
+
+// The online CPU after prev on node in the given pass, or nr_cpu_ids
+static int topo_next(int prev, int node, bool smt)
+{
+	int cpu = prev;
+
+	for (;;) {
+		cpu = cpumask_next(cpu, cpumask_of_node(node));
+		if (cpu >= nr_cpu_ids)
+			return cpu;
+		if (cpu_online(cpu) && topo_smt(cpu) == smt)
+			return cpu;
+	}
+}
+
+/*
+ * Lists up to max online CPUs of the given nodes in the order threads should
+ * take them: one thread per physical core first, SMT siblings only after
+ * every core is used, and in both passes alternating between the nodes so
+ * that each gets its share. Returns the number of CPUs listed and stores the
+ * number of physical cores in nr_core.
+ */
+int topo_cpus(int *cpus, int max, const nodemask_t *nodes, int *nr_core)
+{
+	int *cursor;
+	int node, cpu;
+	int n, added;
+	int pass;
+
+	cursor = kcalloc(nr_node_ids, sizeof(int), GFP_KERNEL);
+	if (!cursor)
+		return 0;
+
+	n = 0;
+	*nr_core = 0;
+	for (pass = 0; pass < 2; pass++) {
+		for_each_node_mask(node, *nodes)
+			cursor[node] = -1;
+
+		do {
+			added = 0;
+			for_each_node_mask(node, *nodes) {
+				cpu = topo_next(cursor[node], node, pass);
+				if (cpu >= nr_cpu_ids)
+					continue;
+
+				cursor[node] = cpu;
+				if (!pass)
+					(*nr_core)++;
+				if (n < max)
+					cpus[n++] = cpu;
+				added++;
+			}
+		} while (added);
+	}
+
+	kfree(cursor);
+	return n;
+}
@@ -0,0 +1,10 @@
+#ifndef _TOPO_H_
+#define _TOPO_H_
+
+#include <linux/nodemask.h>
+#include <linux/types.h>
+
+int topo_cpus(int *cpus, int max, const nodemask_t *nodes, int *nr_core);
+bool topo_smt(int cpu);
+
+#endif
@@ -0,0 +1,238 @@
+#include "tune.h"
+
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/minmax.h>
+#include <linux/sizes.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#define TUNE_MIN_XFER	(DIF_BLOCK_SIZE)	// every operation takes it
+#define TUNE_MIN_BATCH	(2)
+#define TUNE_DEPTH	(32)		// descriptors in flight without batching
+#define TUNE_BYTES	(SZ_64M)	// copied per point
+#define TUNE_MAX_ROUNDS	(1024)
+
+struct tune {
+	struct dsa_chan *c;
+	bool stalled;	// records leaked to a stuck WQ
+
+	void *src, *dst;
+	dma_addr_t src_dma, dst_dma;
+	size_t len;
+
+	// Descriptor list, then one record per descriptor and one for the batch
+	struct dsa_hw_desc *desc;
+	struct dsa_completion_record *comp;
+	dma_addr_t desc_dma, comp_dma;
+	int nr_desc;
+	size_t arena_size;
+};
+
+static void tune_destroy(struct tune *t)
+{
+	// The device may still write these; leak them
+	if (t->stalled)
+		goto out;
+
+	if (t->desc) {
+		chan_unmap(t->c, t->desc_dma, t->arena_size);
+		free_pages_exact(t->desc, t->arena_size);
+	}
+	if (t->src) {
+		chan_unmap(t->c, t->src_dma, t->len);
+		free_pages_exact(t->src, t->len);
+	}
+	if (t->dst) {
+		chan_unmap(t->c, t->dst_dma, t->len);
+		free_pages_exact(t->dst, t->len);
+	}
+out:
+	kfree(t);
+}
+
+// Every descriptor copies the same len bytes
+static struct tune *tune_create(struct dsa_chan *c, int node, size_t len, int nr_desc)
+{
+	struct tune *t;
+
+	t = kzalloc(sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return NULL;
+	t->c = c;
+	t->len = len;
+	t->nr_desc = nr_desc;
+
+	// Page aligned, which covers the list and the records
+	t->arena_size = nr_desc * sizeof(struct dsa_hw_desc) + (nr_desc + 1) * sizeof(struct dsa_completion_record);
+	t->desc = alloc_pages_exact_nid(node, t->arena_size, GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN);
+	t->src = alloc_pages_exact_nid(node, len, GFP_KERNEL | __GFP_NOWARN);
+	t->dst = alloc_pages_exact_nid(node, len, GFP_KERNEL | __GFP_NOWARN);
+	if (!t->desc || !t->src || !t->dst) {
+		printk("kdsa: failed to allocate the tuning buffers\n");
+		tune_destroy(t);
+		return NULL;
+	}
+	memset(t->src, 0x5a, len);
+
+	t->comp = (void *)&t->desc[nr_desc];
+	t->desc_dma = chan_map(c, t->desc, t->arena_size);
+	t->comp_dma = t->desc_dma + nr_desc * sizeof(struct dsa_hw_desc);
+	t->src_dma = chan_map(c, t->src, len);
+	t->dst_dma = chan_map(c, t->dst, len);
+
+	return t;
+}
+
+static inline dma_addr_t tune_comp_dma(struct tune *t, int idx)
+{
+	return t->comp_dma + idx * sizeof(struct dsa_completion_record);
+}
+
+// Returns 0, -EIO if a descriptor failed, or -ETIMEDOUT if the WQ is stuck
+static int tune_reap(struct tune *t, int idx)
+{
+	int rc;
+
+	rc = dsa_poll(t->c, &t->comp[idx]);
+	if (rc == -ETIMEDOUT) {
+		if (chan_drain(t->c))
+			t->stalled = true;
+		return rc;
+	}
+
+	return rc == DSA_COMP_SUCCESS ? 0 : -EIO;
+}
+
+// Runs n descriptors of len bytes, as one BATCH or as n submissions
+static int tune_once(struct tune *t, int n, u32 len, bool batch)
+{
+	struct dsa_hw_desc batch_desc;
+	int i, rc, err = 0;
+
+	memset(t->comp, 0, (n + 1) * sizeof(struct dsa_completion_record));
+
+	if (batch) {
+		dsa_prep(&batch_desc, DSA_OPCODE_BATCH, t->desc_dma, 0, n, tune_comp_dma(t, n), dsa_comp_flags());
+		rc = dsa_submit(t->c, &batch_desc, &t->comp[n], NULL);
+		return rc ? rc : tune_reap(t, n);
+	}
+
+	for (i = 0; i < n; i++) {
+		rc = dsa_submit(t->c, &t->desc[i], &t->comp[i], NULL);
+		if (rc) {
+			err = rc;
+			break;
+		}
+	}
+
+	// Reap whatever went out before a failure
+	n = i;
+	for (i = 0; i < n; i++) {
+		rc = tune_reap(t, i);
+		if (rc == -ETIMEDOUT)
+			return rc;
+		if (rc && !err)
+			err = rc;
+	}
+
+	return err;
+}
+
+// Descriptors per second, or 0 if any of them failed
+static u64 tune_rate(struct tune *t, int n, u32 len, bool batch)
+{
+	u64 rounds, start;
+	int i;
+
+	for (i = 0; i < n; i++)
+		dsa_prep(&t->desc[i], DSA_OPCODE_MEMMOVE, t->src_dma, t->dst_dma, len, tune_comp_dma(t, i), dsa_comp_flags());
+	rounds = clamp_t(u64, div64_u64(TUNE_BYTES, (u64)n * len), 1, TUNE_MAX_ROUNDS);
+
+	// Warm up the caches, the IOTLB and the WQ
+	if (tune_once(t, n, len, batch))
+		return 0;
+
+	start = ktime_get_ns();
+	for (i = 0; i < rounds; i++)
+		if (tune_once(t, n, len, batch))
+			return 0;
+
+	return div64_u64(rounds * n * NSEC_PER_SEC, max_t(u64, ktime_get_ns() - start, 1));
+}
+
+// Index of the first rate within TUNE_KNEE_PCT of the best, or -EIO if none ran
+static int tune_knee(const u64 *rate, int nr)
+{
+	u64 best = 0;
+	int i;
+
+	for (i = 0; i < nr; i++)
+		best = max(best, rate[i]);
+	if (!best)
+		return -EIO;
+
+	for (i = 0; rate[i] * 100 < best * TUNE_KNEE_PCT; i++)
+		;
+	return i;
+}
+
+int tune_xfer(struct dsa_chan *c, int node, u32 max)
+{
+	u64 rate[32];
+	struct tune *t;
+	int depth, nr, i;
+	u32 len;
+
+	if (max < TUNE_MIN_XFER)
+		return -EINVAL;
+
+	// A dedicated WQ drops what does not fit
+	depth = min_t(u32, TUNE_DEPTH, c->wq_size);
+	t = tune_create(c, node, rounddown_pow_of_two(max), depth);
+	if (!t)
+		return -ENOMEM;
+
+	for (nr = 0, len = TUNE_MIN_XFER; len <= max; nr++, len <<= 1) {
+		rate[nr] = tune_rate(t, depth, len, false);
+		if (t->stalled) {
+			tune_destroy(t);
+			return -ETIMEDOUT;
+		}
+		printk("kdsa: tune:       %8u B  %llu MB/s\n", len, div_u64(rate[nr] * len, 1000000));
+		rate[nr] *= len;
+	}
+	tune_destroy(t);
+
+	i = tune_knee(rate, nr);
+	return i < 0 ? i : TUNE_MIN_XFER << i;
+}
+
+int tune_batch(struct dsa_chan *c, int node, u32 len, u32 max)
+{
+	u64 rate[32];
+	struct tune *t;
+	int nr, i;
+	u32 n;
+
+	if (max < TUNE_MIN_BATCH)
+		return -EINVAL;
+
+	t = tune_create(c, node, len, max);
+	if (!t)
+		return -ENOMEM;
+
+	for (nr = 0, n = TUNE_MIN_BATCH; n <= max; nr++, n <<= 1) {
+		rate[nr] = tune_rate(t, n, len, true);
+		if (t->stalled) {
+			tune_destroy(t);
+			return -ETIMEDOUT;
+		}
+		printk("kdsa: tune:       batch %4u  %llu.%03llu MIOPS\n",
+				n, div_u64(rate[nr], 1000000), div_u64(rate[nr], 1000) % 1000);
+	}
+	tune_destroy(t);
+
+	i = tune_knee(rate, nr);
+	return i < 0 ? i : TUNE_MIN_BATCH << i;
+}
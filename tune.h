@@ -0,0 +1,19 @@
+#ifndef _TUNE_H_
+#define _TUNE_H_
+
+#include "driver.h"
+
+/*
+ * Throughput sweeps of MEMMOVE on one channel. Each returns the knee, the
+ * smallest setting that reaches TUNE_KNEE_PCT percent of the best throughput
+ * measured, or a negative error.
+ */
+#define TUNE_KNEE_PCT	(90)
+
+// Transfer size, by bandwidth over powers of two up to max bytes
+int tune_xfer(struct dsa_chan *c, int node, u32 max);
+
+// Descriptors per BATCH of len bytes each, by descriptor rate up to max
+int tune_batch(struct dsa_chan *c, int node, u32 len, u32 max);
+
+#endif
@@ -0,0 +1,435 @@
+#include "workload.h"
+
+#include <linux/crc-t10dif.h>
+#include <linux/crc32c.h>
+#include <linux/math64.h>
+#include <linux/minmax.h>
+#include <linux/moduleparam.h>
+#include <linux/random.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#define WL_MAX_SCHED	(64)	// sum of the weights
+#define WL_PATTERN	(0x5a5aa5a5c3c33c3cULL)
+#define WL_REF_TAG	(0x1000)
+#define WL_DELTA_STRIDE	(DIF_BLOCK_SIZE / sizeof(u64))	// words between changes in WL_SRC2
+
+char workload[WL_SPEC_LEN] = "memmove";
+module_param_string(workload, workload, sizeof(workload), 0444);
+MODULE_PARM_DESC(workload, "Operations and weights, e.g. \"memmove:3,crcgen:1\"; memmove, memfill, compare, compval, cr_delta, ap_delta, dualcast, crcgen, copy_crc, dif_check, dif_ins, dif_strp, cflush (default memmove)");
+
+bool dst_cache;
+module_param(dst_cache, bool, 0444);
+MODULE_PARM_DESC(dst_cache, "Set cache control on every descriptor that writes a destination, so that its data is allocated in the LLC rather than written to memory (default N)");
+
+struct wl_op_info {
+	const char *name;
+	u32 bufs;
+	bool result;	// the completion record carries a value wl_check() needs
+	bool write;	// writes a destination buffer
+	u8 opcode;
+};
+
+static const struct wl_op_info wl_ops[WL_NR_OP] = {
+	[WL_MEMMOVE]	= { "memmove",	 BIT(WL_SRC) | BIT(WL_DST), false, true, DSA_OPCODE_MEMMOVE },
+	[WL_MEMFILL]	= { "memfill",	 BIT(WL_FILL), false, true, DSA_OPCODE_MEMFILL },
+	[WL_COMPARE]	= { "compare",	 BIT(WL_SRC) | BIT(WL_SRC2), true, false, DSA_OPCODE_COMPARE },
+	[WL_COMPVAL]	= { "compval",	 BIT(WL_FILL), true, false, DSA_OPCODE_COMPVAL },
+	[WL_CR_DELTA]	= { "cr_delta",	 BIT(WL_SRC) | BIT(WL_SRC2) | BIT(WL_DELTA), true, true, DSA_OPCODE_CR_DELTA },
+	[WL_AP_DELTA]	= { "ap_delta",	 BIT(WL_SRC) | BIT(WL_DELTA) | BIT(WL_PATCH), false, true, DSA_OPCODE_AP_DELTA },
+	[WL_DUALCAST]	= { "dualcast",	 BIT(WL_SRC) | BIT(WL_DST) | BIT(WL_DST2), false, true, DSA_OPCODE_DUALCAST },
+	[WL_CRCGEN]	= { "crcgen",	 BIT(WL_SRC), true, false, DSA_OPCODE_CRCGEN },
+	[WL_COPY_CRC]	= { "copy_crc",	 BIT(WL_SRC) | BIT(WL_DST), true, true, DSA_OPCODE_COPY_CRC },
+	[WL_DIF_CHECK]	= { "dif_check", BIT(WL_SRC) | BIT(WL_DIF), false, false, DSA_OPCODE_DIF_CHECK },
+	[WL_DIF_INS]	= { "dif_ins",	 BIT(WL_SRC) | BIT(WL_DIF_OUT), false, true, DSA_OPCODE_DIF_INS },
+	[WL_DIF_STRP]	= { "dif_strp",	 BIT(WL_SRC) | BIT(WL_DIF) | BIT(WL_STRP_OUT), false, true, DSA_OPCODE_DIF_STRP },
+	[WL_CFLUSH]	= { "cflush",	 BIT(WL_DST), false, false, DSA_OPCODE_CFLUSH },
+};
+
+static unsigned int wl_weight[WL_NR_OP];
+static u8 wl_sched[WL_MAX_SCHED];
+static unsigned int wl_nr_sched;
+
+static size_t wl_buf_size(int buf, int len)
+{
+	switch (buf) {
+	case WL_DELTA:
+		// One entry per changed word; the device wants room for at least 8
+		return max_t(size_t, DIV_ROUND_UP(len / sizeof(u64), WL_DELTA_STRIDE), 8) * sizeof(struct delta_entry);
+	case WL_DIF:
+	case WL_DIF_OUT:
+		return len / DIF_BLOCK_SIZE * (DIF_BLOCK_SIZE + sizeof(struct dif_tuple));
+	default:
+		return len;
+	}
+}
+
+// max_xfer is that of the channels, which the DIF buffers must fit in
+static bool wl_len_ok(int op, int len, u64 max_xfer)
+{
+	switch (op) {
+	case WL_CR_DELTA:
+	case WL_AP_DELTA:
+		return len % sizeof(u64) == 0 && len <= DELTA_MAX_XFER;
+	case WL_DIF_CHECK:
+	case WL_DIF_INS:
+	case WL_DIF_STRP:
+		return len % DIF_BLOCK_SIZE == 0 && wl_buf_size(WL_DIF, len) <= max_xfer;
+	default:
+		return true;
+	}
+}
+
+// Largest transfer size wl_len_ok() can accept for op
+static u64 wl_max_len_op(int op, u64 max_xfer)
+{
+	switch (op) {
+	case WL_CR_DELTA:
+	case WL_AP_DELTA:
+		return min_t(u64, max_xfer, DELTA_MAX_XFER);
+	case WL_DIF_CHECK:
+	case WL_DIF_INS:
+	case WL_DIF_STRP:
+		return div_u64(max_xfer, DIF_BLOCK_SIZE + sizeof(struct dif_tuple)) * DIF_BLOCK_SIZE;
+	default:
+		return max_xfer;
+	}
+}
+
+static int wl_lookup(const char *name)
+{
+	int op;
+
+	for (op = 0; op < WL_NR_OP; op++)
+		if (strcmp(wl_ops[op].name, name) == 0)
+			return op;
+
+	return -1;
+}
+
+// Smooth weighted round robin, so that the operations are interleaved
+static void wl_build_sched(unsigned int total)
+{
+	int cur[WL_NR_OP] = {};
+	int op, best;
+	unsigned int i;
+
+	for (i = 0; i < total; i++) {
+		best = -1;
+		for (op = 0; op < WL_NR_OP; op++) {
+			if (!wl_weight[op])
+				continue;
+			cur[op] += wl_weight[op];
+			if (best < 0 || cur[op] > cur[best])
+				best = op;
+		}
+		cur[best] -= total;
+		wl_sched[i] = best;
+	}
+	wl_nr_sched = total;
+}
+
+// Parses the workload parameter
+int wl_setup(void)
+{
+	unsigned int weight, total;
+	char *str, *p, *tok, *w;
+	int op;
+	int rc;
+
+	str = kstrdup(workload, GFP_KERNEL);
+	if (!str)
+		return -ENOMEM;
+
+	memset(wl_weight, 0, sizeof(wl_weight));
+	total = 0;
+	rc = -EINVAL;
+
+	p = str;
+	while ((tok = strsep(&p, ",")) != NULL) {
+		if (!*tok)
+			continue;
+
+		weight = 1;
+		w = strchr(tok, ':');
+		if (w) {
+			*w++ = '\0';
+			if (kstrtouint(w, 10, &weight) || weight > WL_MAX_SCHED)
+				goto invalid;
+		}
+
+		op = wl_lookup(tok);
+		if (op < 0)
+			goto invalid;
+
+		wl_weight[op] += weight;
+		total += weight;
+	}
+
+	if (total == 0 || total > WL_MAX_SCHED)
+		goto invalid;
+
+	wl_build_sched(total);
+	rc = 0;
+	goto out;
+
+invalid:
+	printk("kdsa: invalid workload \"%s\"\n", workload);
+out:
+	kfree(str);
+	return rc;
+}
+
+// Checks len, the transfer size per descriptor, against every enabled operation
+int wl_check_len(int len, u64 max_xfer)
+{
+	int op;
+
+	for (op = 0; op < WL_NR_OP; op++) {
+		if (wl_weight[op] && !wl_len_ok(op, len, max_xfer)) {
+			printk("kdsa: %s does not support %d-byte transfers\n", wl_ops[op].name, len);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+u64 wl_max_len(u64 max_xfer)
+{
+	u64 max = max_xfer;
+	int op;
+
+	for (op = 0; op < WL_NR_OP; op++)
+		if (wl_weight[op])
+			max = min(max, wl_max_len_op(op, max_xfer));
+
+	return max;
+}
+
+bool wl_enabled(int op)
+{
+	return wl_weight[op] != 0;
+}
+
+const char *wl_name(int op)
+{
+	return wl_ops[op].name;
+}
+
+bool wl_has_result(int op)
+{
+	return wl_ops[op].result;
+}
+
+u8 wl_opcode(int op)
+{
+	return wl_ops[op].opcode;
+}
+
+// Fills the buffers so that every operation has a known result
+static void wl_fill(struct workload *wl)
+{
+	int nr_word = wl->len / sizeof(u64);
+	u64 pattern = WL_PATTERN;
+	struct delta_entry *delta;
+	struct dif_tuple *dif;
+	u64 *src, *src2;
+	u8 *p;
+	int i, n;
+
+	if (wl->buf[WL_FILL]) {
+		p = wl->buf[WL_FILL];
+		for (i = 0; i < wl->len; i++)
+			p[i] = ((u8 *)&pattern)[i % sizeof(pattern)];
+	}
+
+	src = wl->buf[WL_SRC];
+	if (!src)
+		return;
+
+	get_random_bytes(src, wl->len);
+
+	// The device inverts both the seed and the result by default
+	wl->crc = ~crc32c(~0U, src, wl->len);
+
+	if (wl->buf[WL_SRC2]) {
+		src2 = wl->buf[WL_SRC2];
+		memcpy(src2, src, wl->len);
+		for (i = 0; i < nr_word; i += WL_DELTA_STRIDE)
+			src2[i] = ~src[i];
+	}
+
+	if (wl->buf[WL_DELTA]) {
+		delta = wl->buf[WL_DELTA];
+		for (i = 0, n = 0; i < nr_word; i += WL_DELTA_STRIDE, n++) {
+			delta[n].offset = i;
+			delta[n].data = ~src[i];
+		}
+		wl->delta_size = n * sizeof(struct delta_entry);
+	}
+
+	if (wl->buf[WL_PATCH])
+		memcpy(wl->buf[WL_PATCH], src, wl->len);
+
+	if (wl->buf[WL_DIF]) {
+		p = wl->buf[WL_DIF];
+		for (i = 0; i < wl->len / DIF_BLOCK_SIZE; i++) {
+			memcpy(p, (u8 *)src + i * DIF_BLOCK_SIZE, DIF_BLOCK_SIZE);
+			dif = (struct dif_tuple *)(p + DIF_BLOCK_SIZE);
+			dif->guard = cpu_to_be16(crc_t10dif(p, DIF_BLOCK_SIZE));
+			dif->app_tag = 0;
+			dif->ref_tag = cpu_to_be32(WL_REF_TAG + i);
+			p += DIF_BLOCK_SIZE + sizeof(*dif);
+		}
+	}
+}
+
+// Buffers are allocated on node
+int wl_init(struct workload *wl, struct dsa_chan *chan, int len, int node)
+{
+	u32 bufs = 0;
+	int op, i;
+
+	memset(wl, 0, sizeof(*wl));
+	wl->chan = chan;
+	wl->len = len;
+
+	if (dst_cache && !chan->cc_cache)
+		printk_once("kdsa: %s ignores cache control; destination writes go to memory\n", chan->name);
+
+	for (op = 0; op < WL_NR_OP; op++)
+		if (wl_weight[op])
+			bufs |= wl_ops[op].bufs;
+
+	// Page aligned, as DUALCAST needs both destinations at the same page offset
+	for (i = 0; i < WL_NR_BUF; i++) {
+		if (!(bufs & BIT(i)))
+			continue;
+
+		wl->size[i] = wl_buf_size(i, len);
+		wl->buf[i] = alloc_pages_exact_nid(node, wl->size[i], GFP_KERNEL | __GFP_ZERO);
+		if (!wl->buf[i])
+			goto failure;
+	}
+
+	wl_fill(wl);
+
+	for (i = 0; i < WL_NR_BUF; i++)
+		if (wl->buf[i])
+			wl->dma[i] = chan_map(chan, wl->buf[i], wl->size[i]);
+
+	return 0;
+
+failure:
+	for (i = 0; i < WL_NR_BUF; i++)
+		if (wl->buf[i])
+			free_pages_exact(wl->buf[i], wl->size[i]);
+
+	return 1;
+}
+
+void wl_exit(struct workload *wl)
+{
+	int i;
+
+	for (i = 0; i < WL_NR_BUF; i++) {
+		if (!wl->buf[i])
+			continue;
+
+		chan_unmap(wl->chan, wl->dma[i], wl->size[i]);
+		free_pages_exact(wl->buf[i], wl->size[i]);
+	}
+}
+
+int wl_next(struct workload *wl)
+{
+	int op = wl_sched[wl->pos];
+
+	if (++wl->pos == wl_nr_sched)
+		wl->pos = 0;
+
+	return op;
+}
+
+void wl_prep(struct workload *wl, struct dsa_hw_desc *desc, int op, u64 compl, u32 flags)
+{
+	dma_addr_t *dma = wl->dma;
+	int len = wl->len;
+
+	if (dst_cache && wl_ops[op].write)
+		flags |= IDXD_OP_FLAG_CC;
+
+	switch (op) {
+	case WL_MEMMOVE:
+		dsa_prep(desc, DSA_OPCODE_MEMMOVE, dma[WL_SRC], wl->copy_dst, len, compl, flags);
+		break;
+	case WL_MEMFILL:
+		dsa_prep(desc, DSA_OPCODE_MEMFILL, WL_PATTERN, dma[WL_FILL], len, compl, flags);
+		break;
+	case WL_COMPARE:
+		dsa_prep(desc, DSA_OPCODE_COMPARE, dma[WL_SRC], dma[WL_SRC2], len, compl, flags);
+		break;
+	case WL_COMPVAL:
+		dsa_prep(desc, DSA_OPCODE_COMPVAL, dma[WL_FILL], WL_PATTERN, len, compl, flags);
+		break;
+	case WL_CR_DELTA:
+		dsa_prep(desc, DSA_OPCODE_CR_DELTA, dma[WL_SRC], dma[WL_SRC2], len, compl, flags);
+		desc->delta_addr = dma[WL_DELTA];
+		desc->max_delta_size = wl->size[WL_DELTA];
+		break;
+	case WL_AP_DELTA:
+		dsa_prep(desc, DSA_OPCODE_AP_DELTA, dma[WL_DELTA], dma[WL_PATCH], len, compl, flags);
+		desc->delta_rec_size = wl->delta_size;
+		break;
+	case WL_DUALCAST:
+		dsa_prep(desc, DSA_OPCODE_DUALCAST, dma[WL_SRC], dma[WL_DST], len, compl, flags);
+		desc->dest2 = dma[WL_DST2];
+		break;
+	case WL_CRCGEN:
+		dsa_prep(desc, DSA_OPCODE_CRCGEN, dma[WL_SRC], 0, len, compl, flags);
+		break;
+	case WL_COPY_CRC:
+		dsa_prep(desc, DSA_OPCODE_COPY_CRC, dma[WL_SRC], dma[WL_DST], len, compl, flags);
+		break;
+
+	// 512-byte blocks, incrementing reference tags, application tags of 0 (seed and mask 0)
+	case WL_DIF_CHECK:
+		dsa_prep(desc, DSA_OPCODE_DIF_CHECK, dma[WL_DIF], 0, wl->size[WL_DIF], compl, flags);
+		desc->chk_ref_tag_seed = WL_REF_TAG;
+		break;
+	case WL_DIF_INS:
+		dsa_prep(desc, DSA_OPCODE_DIF_INS, dma[WL_SRC], dma[WL_DIF_OUT], len, compl, flags);
+		desc->ins_ref_tag_seed = WL_REF_TAG;
+		break;
+	case WL_DIF_STRP:
+		dsa_prep(desc, DSA_OPCODE_DIF_STRP, dma[WL_DIF], dma[WL_STRP_OUT], wl->size[WL_DIF], compl, flags);
+		desc->chk_ref_tag_seed = WL_REF_TAG;
+		break;
+
+	case WL_CFLUSH:
+		dsa_prep(desc, DSA_OPCODE_CFLUSH, 0, dma[WL_DST], len, compl, flags);
+		break;
+	}
+}
+
+// Whether the record holds the result the buffers were filled for
+bool wl_check(struct workload *wl, int op, const struct dsa_completion_record *comp)
+{
+	if (DSA_COMP_STATUS(comp->status) != DSA_COMP_SUCCESS)
+		return false;
+
+	switch (op) {
+	case WL_COMPARE:
+		return comp->result == 1;
+	case WL_COMPVAL:
+		return comp->result == 0;
+	case WL_CR_DELTA:
+		return comp->result == 1 && comp->delta_rec_size == wl->delta_size;
+	case WL_CRCGEN:
+	case WL_COPY_CRC:
+		return (u32)comp->crc_val == wl->crc;
+	default:
+		return true;
+	}
+}
@@ -0,0 +1,83 @@
+#ifndef _WORKLOAD_H_
+#define _WORKLOAD_H_
+
+#include "driver.h"
+
+/*
+ * Operations a thread can issue. The workload module parameter picks them and
+ * their weights, e.g. "memmove:3,crcgen:1", and every thread cycles through
+ * the same interleaved schedule.
+ */
+enum wl_op {
+	WL_MEMMOVE = 0,
+	WL_MEMFILL,
+	WL_COMPARE,
+	WL_COMPVAL,
+	WL_CR_DELTA,
+	WL_AP_DELTA,
+	WL_DUALCAST,
+	WL_CRCGEN,
+	WL_COPY_CRC,
+	WL_DIF_CHECK,
+	WL_DIF_INS,
+	WL_DIF_STRP,
+	WL_CFLUSH,
+	WL_NR_OP,
+};
+
+// Per-thread buffers; only those used by the selected operations exist
+enum wl_buf {
+	WL_SRC = 0,	// random data
+	WL_SRC2,	// WL_SRC with one word changed per DIF block
+	WL_DST,
+	WL_DST2,
+	WL_FILL,	// WL_PATTERN
+	WL_DELTA,	// delta record of WL_SRC against WL_SRC2
+	WL_PATCH,
+	WL_DIF,		// WL_SRC with protection information
+	WL_DIF_OUT,
+	WL_STRP_OUT,
+	WL_NR_BUF,
+};
+
+struct workload {
+	struct dsa_chan *chan;
+	int len;
+
+	void *buf[WL_NR_BUF];
+	dma_addr_t dma[WL_NR_BUF];
+	size_t size[WL_NR_BUF];
+	dma_addr_t copy_dst;	// MEMMOVE destination, may be device memory
+
+	// Expected results
+	u32 crc;
+	u32 delta_size;
+
+	unsigned int pos;
+};
+
+// Module parameters, also set through the benchmark's config file
+#define WL_SPEC_LEN	(256)
+
+extern char workload[WL_SPEC_LEN];
+extern bool dst_cache;
+
+int wl_setup(void);
+int wl_check_len(int len, u64 max_xfer);
+
+// Largest transfer size every enabled operation takes on channels with max_xfer
+u64 wl_max_len(u64 max_xfer);
+
+bool wl_enabled(int op);
+const char *wl_name(int op);
+bool wl_has_result(int op);
+u8 wl_opcode(int op);
+
+int wl_init(struct workload *wl, struct dsa_chan *chan, int len, int node);
+void wl_exit(struct workload *wl);
+
+int wl_next(struct workload *wl);
+void wl_prep(struct workload *wl, struct dsa_hw_desc *desc, int op, u64 compl, u32 flags);
+bool wl_check(struct workload *wl, int op, const struct dsa_completion_record *comp);
+
+#endif